@@ -2,8 +2,18 @@
 #include "lbuffer.h"
 
 
+#include <errno.h>
+#include <stddef.h>
 #include <string.h>
 
+#if !defined(LB_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  define LB_MMAP
+#endif
+
 
 #define MAX_SIZE_T ((size_t)(~(size_t)0) - 2)
 
@@ -63,40 +73,328 @@ static int type_error(lua_State *L, int narg, const char *tname) {
 }
 
 
+/* storage management */
+
+static void *buff_realloc(lua_State *L, void *p, size_t osize, size_t nsize) {
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(L, &ud);
+    return allocf(ud, p, osize, nsize);
+}
+
+static void buff_gcpressure(lua_State *L, size_t osize, size_t nsize) {
+    /* storage is allocated behind the collector's back, report the
+     * growth (in kilobytes) to keep it paced with the real memory
+     * usage.  */
+    int kb = (int)((nsize >> 10) - (osize >> 10));
+#if LUA_VERSION_NUM >= 502
+    if (!lua_gc(L, LUA_GCISRUNNING, 0)) return;
+#endif
+    if (kb > 0) lua_gc(L, LUA_GCSTEP, kb);
+}
+
+
+/* storage pool */
+
+#define LB_POOLKEY    0xF7B2FFE8
+#define POOL_MINBITS  6   /* smallest size class is 64 bytes */
+#define POOL_CLASSES  16  /* biggest size class is 2M bytes */
+
+typedef struct lb_Pool {
+    void *blocks[POOL_CLASSES]; /* free lists of each size class */
+    size_t limit;   /* max bytes of cached storage */
+    size_t bytes;   /* bytes of cached storage */
+    size_t nblocks; /* number of cached blocks */
+    size_t hits, misses;
+} lb_Pool;
+
+static lb_Pool *get_pool(lua_State *L) {
+    lb_Pool *pool;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LB_POOLKEY);
+    pool = (lb_Pool*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return pool;
+}
+
+static int pool_class(size_t *psize) {
+    /* round size up to its size class, -1 if it's too big */
+    size_t size = (size_t)1 << POOL_MINBITS;
+    int c = 0;
+    while (size < *psize && ++c < POOL_CLASSES)
+        size <<= 1;
+    if (c == POOL_CLASSES) return -1;
+    *psize = size;
+    return c;
+}
+
+static void pool_trim(lua_State *L, lb_Pool *pool) {
+    int c = POOL_CLASSES;
+    while (pool->bytes > pool->limit && c-- > 0) {
+        size_t size = (size_t)1 << (POOL_MINBITS + c);
+        while (pool->bytes > pool->limit && pool->blocks[c] != NULL) {
+            void *p = pool->blocks[c];
+            pool->blocks[c] = *(void**)p;
+            pool->bytes -= size;
+            pool->nblocks -= 1;
+            buff_realloc(L, p, size, 0);
+        }
+    }
+}
+
+static int pool_gc(lua_State *L) {
+    lb_Pool *pool = (lb_Pool*)lua_touserdata(L, 1);
+    /* buffers finalized later return storage to allocator directly */
+    pool->limit = 0;
+    pool_trim(L, pool);
+    return 0;
+}
+
+static char *storage_alloc(lb_Buffer *B, size_t *psize) {
+    lb_Pool *pool;
+    void *p;
+    int c;
+    if ((B->flags & LB_POOLED) && (pool = get_pool(B->L)) != NULL
+            && (c = pool_class(psize)) >= 0) {
+        if ((p = pool->blocks[c]) != NULL) {
+            pool->blocks[c] = *(void**)p;
+            pool->bytes -= *psize;
+            pool->nblocks -= 1;
+            pool->hits += 1;
+            return (char*)p;
+        }
+        pool->misses += 1;
+    }
+    /* caller reports gc pressure, after it owns the storage */
+    return (char*)buff_realloc(B->L, NULL, 0, *psize);
+}
+
+static void storage_free(lb_Buffer *B, char *p, size_t size) {
+    lb_Pool *pool;
+    size_t csize = size;
+    int c;
+    if ((B->flags & LB_POOLED) && (pool = get_pool(B->L)) != NULL
+            && pool->bytes <= pool->limit && pool->limit - pool->bytes >= size
+            && (c = pool_class(&csize)) >= 0 && csize == size) {
+        *(void**)p = pool->blocks[c];
+        pool->blocks[c] = p;
+        pool->bytes += size;
+        pool->nblocks += 1;
+        return;
+    }
+    buff_realloc(B->L, p, size, 0);
+}
+
+
+/* box of lb_buffinit() buffers, a userdata on stack owns their heap
+ * storage, so it's freed by __gc if a error unwinds the builder */
+
+#define LB_BOXKEY     0xF7B2FFEA
+
+typedef struct lb_Box {
+    char *b;
+    size_t size;
+} lb_Box;
+
+static int box_gc(lua_State *L) {
+    lb_Box *box = (lb_Box*)lua_touserdata(L, 1);
+    if (box->b != NULL) {
+        buff_realloc(L, box->b, box->size, 0);
+        box->b = NULL;
+    }
+    return 0;
+}
+
+static void box_new(lb_Buffer *B) {
+    lua_State *L = B->L;
+    lb_Box *box;
+    luaL_checkstack(L, 3, "no space for buffer box");
+    box = (lb_Box*)lua_newuserdata(L, sizeof(lb_Box));
+    box->b = NULL;
+    box->size = 0;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LB_BOXKEY);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, box_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LB_BOXKEY);
+    }
+    lua_setmetatable(L, -2);
+    B->box = box;
+}
+
+static void box_update(lb_Buffer *B) {
+    /* let box own the current storage of B */
+    lb_Box *box = (lb_Box*)B->box;
+    if (box != NULL) {
+        box->b = B->b - B->head == B->initb ? NULL : B->b - B->head;
+        box->size = B->size + B->head;
+    }
+}
+
+static void buff_compact(lb_Buffer *B) {
+    /* move content back to the front of storage */
+    lb_closegap(B);
+    memmove(B->b - B->head, B->b, B->n * sizeof(char));
+    B->b -= B->head;
+    B->size += B->head;
+    B->head = 0;
+}
+
+static void buff_unmap(lb_Buffer *B, size_t newsize) {
+    /* move content of mapped file to storage of newsize bytes */
+    size_t initsize = (B->flags & LB_SMALL) ? LB_INLINESIZE : LUAL_BUFFERSIZE;
+    char *newbuff = B->initb;
+    if (newsize <= initsize)
+        newsize = initsize;
+    else if ((newbuff = storage_alloc(B, &newsize)) == NULL)
+        luaL_error(B->L, "not enough memory for buffer");
+    memcpy(newbuff, B->b, B->n * sizeof(char));
+#ifdef LB_MMAP
+    munmap(B->b - B->head, B->size + B->head);
+#endif
+    B->b = newbuff;
+    B->size = newsize;
+    B->head = 0;
+    B->flags &= ~(LB_MAPPED | LB_READONLY);
+    if (newbuff != B->initb)
+        buff_gcpressure(B->L, 0, newsize);
+}
+
+static void buff_resize(lb_Buffer *B, size_t newsize) {
+    /* move content to storage of newsize bytes, must fit B->n */
+    size_t initsize = (B->flags & LB_SMALL) ? LB_INLINESIZE : LUAL_BUFFERSIZE;
+    size_t oldsize;
+    char *newbuff;
+    if (B->flags & LB_GAPOPEN)
+        lb_closegap(B);
+    if (B->flags & LB_VIEW)
+        luaL_error(B->L, "sub buffer can not be resized");
+    if (B->subs != 0)
+        luaL_error(B->L, "buffer is pinned by %d sub buffer(s)", (int)B->subs);
+    if (B->flags & LB_MAPPED) {
+        buff_unmap(B, newsize);
+        return;
+    }
+    if (B->head != 0)
+        buff_compact(B);
+    if (newsize <= initsize) { /* fit in inline area? */
+        if (B->b != B->initb) {
+            memcpy(B->initb, B->b, B->n * sizeof(char));
+            storage_free(B, B->b, B->size);
+            B->b = B->initb;
+            B->size = initsize;
+            box_update(B);
+        }
+        return;
+    }
+    if ((B->flags & LB_ONSTACK) && B->box == NULL)
+        box_new(B); /* anchor storage before allocating it */
+    oldsize = B->b != B->initb ? B->size : 0;
+    if (B->b != B->initb && !(B->flags & LB_POOLED)) /* resize in place */
+        newbuff = (char*)buff_realloc(B->L, B->b, B->size, newsize);
+    else if ((newbuff = storage_alloc(B, &newsize)) != NULL) {
+        memcpy(newbuff, B->b, B->n * sizeof(char));
+        if (B->b != B->initb)
+            storage_free(B, B->b, B->size);
+    }
+    if (newbuff == NULL)
+        luaL_error(B->L, "not enough memory for buffer");
+    B->b = newbuff;
+    B->size = newsize;
+    box_update(B);
+    /* a gc step may run finalizers that raise, B must be valid now */
+    buff_gcpressure(B->L, oldsize, newsize);
+}
+
+LB_API void lb_setpoollimit(lua_State *L, size_t limit) {
+    lb_Pool *pool = get_pool(L);
+    if (pool == NULL) {
+        if (limit == 0) return;
+        pool = (lb_Pool*)lua_newuserdata(L, sizeof(lb_Pool));
+        memset(pool, 0, sizeof(lb_Pool));
+        lua_createtable(L, 0, 1);
+        lua_pushcfunction(L, pool_gc);
+        lua_setfield(L, -2, "__gc");
+        lua_setmetatable(L, -2);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LB_POOLKEY);
+    }
+    pool->limit = limit;
+    pool_trim(L, pool);
+}
+
+LB_API void lb_pushpoolinfo(lua_State *L) {
+    lb_Pool *pool = get_pool(L);
+    lua_createtable(L, 0, 7);
+    lua_pushinteger(L, pool ? pool->limit : 0);
+    lua_setfield(L, -2, "limit");
+    lua_pushinteger(L, pool ? pool->bytes : 0);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, pool ? pool->nblocks : 0);
+    lua_setfield(L, -2, "blocks");
+    lua_pushinteger(L, pool ? pool->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, pool ? pool->misses : 0);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, (lua_Integer)1 << POOL_MINBITS);
+    lua_setfield(L, -2, "minblock");
+    lua_pushinteger(L, (lua_Integer)1 << (POOL_MINBITS + POOL_CLASSES - 1));
+    lua_setfield(L, -2, "maxblock");
+}
+
+
 /* luaL_Buffer compatible interface */
 
-LB_API void lb_buffinit(lua_State *L, lb_Buffer *B) {
+static void buff_init(lua_State *L, lb_Buffer *B, unsigned int flags) {
     B->L = L;
     B->b = B->initb;
     B->n = 0;
-    B->size = LUAL_BUFFERSIZE;
+    B->flags = flags;
+    B->subs = 0;
+    B->head = 0;
+    B->box = NULL;
+    B->size = (flags & LB_SMALL) ? LB_INLINESIZE : LUAL_BUFFERSIZE;
+}
+
+LB_API void lb_buffinit(lua_State *L, lb_Buffer *B) {
+    buff_init(L, B, LB_ONSTACK);
 }
 
 LB_API char *lb_prepbuffsize(lb_Buffer *B, size_t sz) {
-    lua_State *L = B->L;
+    if (B->size - B->n < sz && B->head != 0 && B->subs == 0
+            && !(B->flags & (LB_VIEW | LB_MAPPED)))
+        buff_compact(B); /* reuse space of consumed bytes first */
     if (B->size - B->n < sz) {  /* not enough space? */
-        char *newbuff;
-        size_t newsize = B->size * 2;  /* double buffer size */
-        if (newsize - B->n < sz)  /* not big enough? */
+        size_t newsize = B->size;
+        switch (B->flags & LB_GROWMASK) {
+        case LB_GROWHALF:
+            newsize += B->size / 2; break;
+        case LB_GROWFIXED:
+            newsize += B->size < LB_GROWSTEP ? B->size : LB_GROWSTEP;
+            break;
+        default: /* double buffer size */
+            newsize *= 2; break;
+        }
+        if (newsize < B->size || newsize - B->n < sz)  /* not big enough? */
             newsize = B->n + sz;
         if (newsize < B->n || newsize - B->n < sz)
-            luaL_error(L, "buffer too large");
-        /* create larger buffer */
-        newbuff = (char*)lua_newuserdata(L, newsize * sizeof(char));
-        /* move content to new buffer */
-        memcpy(newbuff, B->b, B->n * sizeof(char));
-        /* remove old buffer and archor new buffer */
-        lua_pushvalue(L, -1);
-        lua_rawsetp(L, LUA_REGISTRYINDEX, B);
-        B->b = newbuff;
-        B->size = newsize;
+            luaL_error(B->L, "buffer too large");
+        buff_resize(B, newsize);
     }
     return &B->b[B->n];
 }
 
 LB_API void lb_addlstring(lb_Buffer *B, const char *s, size_t l) {
-    char *b = lb_prepbuffsize(B, l);
-    memcpy(b, s, l * sizeof(char));
+    char *b;
+    if (s >= B->b && s < B->b + B->size) { /* s is inside B? */
+        size_t offset = s - B->b; /* storage may move, rebase s */
+        b = lb_prepbuffsize(B, l);
+        memmove(b, &B->b[offset], l * sizeof(char));
+    }
+    else {
+        b = lb_prepbuffsize(B, l);
+        memcpy(b, s, l * sizeof(char));
+    }
     lb_addsize(B, l);
 }
 
@@ -112,15 +410,92 @@ LB_API void lb_addpadding(lb_Buffer *B, int ch, size_t l) {
 
 LB_API void lb_addvalue(lb_Buffer *B) {
     lua_State *L = B->L;
+    int idx = lua_gettop(L) + 1; /* a box may be pushed above it */
     size_t l;
     const char *s = luaL_tolstring(L, -1, &l);
     lb_addlstring(B, s, l);
-    lua_pop(L, 1);
+    lua_remove(L, idx);
 }
 
 LB_API void lb_pushresult(lb_Buffer *B) {
-    lua_pushlstring(B->L, B->b, B->n);
+    lua_State *L = B->L;
+    void *box = B->box;
+    lb_pushintern(L, B->b, B->n);
     lb_resetbuffer(B);
+    if (box != NULL && lua_touserdata(L, -2) == box)
+        lua_remove(L, -2);
+}
+
+
+/* capacity management */
+
+LB_API char *lb_reservebuffer(lb_Buffer *B, size_t cap) {
+    if (lb_capacity(B) < cap)
+        buff_resize(B, cap);
+    else if (B->size < cap && B->subs == 0
+            && !(B->flags & (LB_VIEW | LB_MAPPED)))
+        buff_compact(B); /* space of consumed bytes is enough */
+    return &B->b[B->n];
+}
+
+LB_API void lb_shrinkbuffer(lb_Buffer *B) {
+    if (B->b != B->initb && B->size != B->n
+            && B->subs == 0 && !(B->flags & (LB_VIEW | LB_MAPPED)))
+        buff_resize(B, B->n);
+}
+
+LB_API void lb_setgrowth(lb_Buffer *B, unsigned int policy) {
+    B->flags = (B->flags & ~LB_GROWMASK) | (policy & LB_GROWMASK);
+}
+
+LB_API void lb_consume(lb_Buffer *B, size_t sz) {
+    lb_closegap(B);
+    if (sz >= B->n) { /* all consumed, rewind to front of storage */
+        B->b -= B->head;
+        B->size += B->head;
+        B->head = 0;
+        B->n = 0;
+    }
+    else if (B->subs != 0 || (B->flags & LB_VIEW)) {
+        /* keep sub buffers at their offsets */
+        memmove(B->b, &B->b[sz], (B->n - sz) * sizeof(char));
+        B->n -= sz;
+    }
+    else {
+        B->b += sz;
+        B->size -= sz;
+        B->head += sz;
+        B->n -= sz;
+    }
+}
+
+
+/* gap mode */
+
+LB_API char *lb_opengap(lb_Buffer *B, size_t pos, size_t sz) {
+    size_t tail;
+    if (!(B->flags & LB_GAPOPEN) || B->size - B->n < sz) {
+        lb_closegap(B);
+        lb_prepbuffsize(B, sz);
+        B->gap = B->n; /* open at the end */
+        B->flags |= LB_GAPOPEN;
+    }
+    tail = B->n - B->gap;
+    if (pos < B->gap) /* move content before gap to tail */
+        memmove(&B->b[B->size - tail - (B->gap - pos)], &B->b[pos],
+                B->gap - pos);
+    else if (pos > B->gap) /* move content of tail to before gap */
+        memmove(&B->b[B->gap], &B->b[B->size - tail], pos - B->gap);
+    B->gap = pos;
+    return &B->b[pos];
+}
+
+LB_API void lb_closegap(lb_Buffer *B) {
+    if (B->flags & LB_GAPOPEN) {
+        size_t tail = B->n - B->gap;
+        memmove(&B->b[B->gap], &B->b[B->size - tail], tail);
+        B->flags &= ~LB_GAPOPEN;
+    }
 }
 
 
@@ -131,8 +506,13 @@ static void get_metatable_fast(lua_State *L) {
 }
 
 LB_API lb_Buffer *lb_newbuffer(lua_State *L) {
-    lb_Buffer *B = (lb_Buffer*)lua_newuserdata(L, sizeof(lb_Buffer));
-    lb_buffinit(L, B);
+    /* buffer objects only carry a small inline area, bigger contents
+     * live in heap storage anyway */
+    lb_Pool *pool = get_pool(L);
+    lb_Buffer *B = (lb_Buffer*)lua_newuserdata(L,
+            offsetof(lb_Buffer, initb) + LB_INLINESIZE);
+    buff_init(L, B, LB_SMALL |
+            (pool != NULL && pool->limit != 0 ? LB_POOLED : 0));
     get_metatable_fast(L);
     lua_setmetatable(L, -2);
     return B;
@@ -146,11 +526,21 @@ LB_API lb_Buffer *lb_copybuffer(lb_Buffer *B) {
 
 LB_API void lb_resetbuffer(lb_Buffer *B) {
     lua_State *L = B->L;
-    if (B->b != B->initb) { /* remove old buffer */
-        lua_pushnil(L);
-        lua_rawsetp(L, LUA_REGISTRYINDEX, B);
+    if (B->subs != 0 || (B->flags & LB_VIEW)) { /* storage is not ours */
+        B->flags &= ~LB_GAPOPEN;
+        B->n = 0;
+        return;
     }
-    lb_buffinit(L, B);
+#ifdef LB_MMAP
+    if (B->flags & LB_MAPPED)
+        munmap(B->b - B->head, B->size + B->head);
+    else
+#endif
+    if (B->b - B->head != B->initb) { /* release heap storage */
+        storage_free(B, B->b - B->head, B->size + B->head);
+        if (B->box != NULL) ((lb_Box*)B->box)->b = NULL;
+    }
+    buff_init(L, B, B->flags & ~(LB_GAPOPEN | LB_MAPPED | LB_READONLY));
 }
 
 LB_API lb_Buffer *lb_testbuffer(lua_State *L, int narg) {
@@ -161,6 +551,11 @@ LB_API lb_Buffer *lb_testbuffer(lua_State *L, int narg) {
         get_metatable_fast(L);
         if (!lua_rawequal(L, -1, -2))  /* not the same? */
             p = NULL;  /* value is a userdata with wrong metatable */
+        else { /* the creating thread may be gone, use the current one */
+            ((lb_Buffer*)p)->L = L;
+            if (((lb_Buffer*)p)->flags & LB_GAPOPEN)
+                lb_closegap((lb_Buffer*)p);
+        }
         lua_pop(L, 2);  /* remove both metatables */
         return (lb_Buffer*)p;
     }
@@ -181,6 +576,113 @@ LB_API lb_Buffer *lb_pushbuffer(lua_State *L, const char *str, size_t len) {
 }
 
 
+/* sub buffers */
+
+LB_API lb_Buffer *lb_subbuffer(lua_State *L, int narg, size_t pos, size_t len) {
+    /* the parent is kept in the uservalue of sub buffer, sub buffers of
+     * sub buffers refer to the buffer owns the storage directly */
+    lb_Buffer *P = lb_checkbuffer(L, narg), *B;
+    narg = lua_absindex(L, narg);
+    if (pos > P->n) pos = P->n;
+    if (len > P->n - pos) len = P->n - pos;
+    lua_createtable(L, 1, 0);
+    if (P->flags & LB_VIEW) {
+        const char *b = P->b;
+        if ((P = lb_parentbuffer(L, narg)) == NULL)
+            luaL_error(L, "sub buffer without parent");
+        pos += b - P->b;
+    }
+    else
+        lua_pushvalue(L, narg);
+    lua_rawseti(L, -2, 1);
+    B = lb_newbuffer(L);
+    lua_insert(L, -2);
+    lua_setuservalue(L, -2);
+    B->flags = ((B->flags | LB_VIEW) & ~LB_POOLED) | (P->flags & LB_READONLY);
+    B->b = P->b + pos;
+    B->n = B->size = len;
+    P->subs += 1;
+    return B;
+}
+
+LB_API lb_Buffer *lb_parentbuffer(lua_State *L, int narg) {
+    /* pushes the parent of sub buffer, or returns NULL */
+    lb_Buffer *B = lb_testbuffer(L, narg), *P;
+    if (B == NULL || !(B->flags & LB_VIEW))
+        return NULL;
+    lua_getuservalue(L, narg);
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+    if ((P = lb_testbuffer(L, -1)) == NULL)
+        lua_pop(L, 1);
+    return P;
+}
+
+LB_API void lb_releasebuffer(lua_State *L, int narg) {
+    /* detaches a sub buffer from its parent, it becomes empty */
+    lb_Buffer *B = lb_checkbuffer(L, narg), *P;
+    narg = lua_absindex(L, narg);
+    if (!(B->flags & LB_VIEW))
+        return;
+    if ((P = lb_parentbuffer(L, narg)) != NULL) {
+        if (P->subs != 0) P->subs -= 1;
+        lua_pop(L, 1);
+    }
+    lua_getuservalue(L, narg);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, 1);
+    lua_pop(L, 1);
+    buff_init(L, B, B->flags & ~(LB_VIEW|LB_READONLY));
+}
+
+
+/* memory mapped files */
+
+LB_API lb_Buffer *lb_mapfile(lua_State *L, const char *path, int writable) {
+#ifdef LB_MMAP
+    /* create buffer object first, so the mapping never leaks */
+    lb_Buffer *B = lb_newbuffer(L);
+    struct stat st;
+    void *p = NULL;
+    int fd, en = 0;
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        lua_pop(L, 1);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0)
+        en = errno;
+    else if (S_ISDIR(st.st_mode))
+        en = EISDIR;
+    else if (!S_ISREG(st.st_mode))
+        en = ENODEV;
+    else if ((off_t)(size_t)st.st_size != st.st_size)
+        en = EFBIG;
+    else if (st.st_size != 0 && (p = mmap(NULL, (size_t)st.st_size,
+                    writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                    MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        en = errno;
+    close(fd);
+    if (en != 0) {
+        lua_pop(L, 1);
+        errno = en;
+        return NULL;
+    }
+    if (p != NULL) { /* empty file can not be mapped */
+        B->b = (char*)p;
+        B->n = B->size = (size_t)st.st_size;
+        B->flags |= LB_MAPPED;
+    }
+    if (!writable)
+        B->flags |= LB_READONLY;
+    return B;
+#else
+    (void)L; (void)path; (void)writable;
+    errno = ENOSYS;
+    return NULL;
+#endif
+}
+
+
 /* compatible with lua api */
 
 LB_API int lb_isbufferorstring(lua_State *L, int narg) {
@@ -218,12 +720,33 @@ LB_API const char *lb_optlstring(lua_State *L, int narg, const char *def, size_t
 #ifndef _MSC_VER
 #  include <stdint.h>
 #else
+#  define uint16_t unsigned short
 #  define uint32_t unsigned long
 #  define uint64_t unsigned __int64
 #  define int32_t signed long
 #  define int64_t signed __int64
 #endif
 
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8))
+#  define bswap16(n) __builtin_bswap16(n)
+#  define bswap32(n) __builtin_bswap32(n)
+#  define bswap64(n) __builtin_bswap64(n)
+#elif defined(_MSC_VER)
+#  include <stdlib.h>
+#  define bswap16(n) _byteswap_ushort(n)
+#  define bswap32(n) _byteswap_ulong(n)
+#  define bswap64(n) _byteswap_uint64(n)
+#else
+#  define bswap16(n) ((uint16_t)((n) >> 8 | (n) << 8))
+static uint32_t bswap32(uint32_t n) {
+    n = (n >> 16) | (n << 16);
+    return ((n & 0xFF00FF00) >> 8) | ((n & 0x00FF00FF) << 8);
+}
+static uint64_t bswap64(uint64_t n) {
+    return (uint64_t)bswap32((uint32_t)n) << 32 | bswap32((uint32_t)(n >> 32));
+}
+#endif
+
 typedef union numcast_t {
     uint32_t i32;
     float f;
@@ -231,146 +754,422 @@ typedef union numcast_t {
     double d;
 } numcast_t;
 
-static uint32_t read_int32(const char *s, int bigendian, int wide) {
-    uint32_t n = 0;
-    if (bigendian) {
-        switch (wide) {
-        default: return 0;
-        case 4:          n |= *s++ & 0xFF;
-        case 3: n <<= 8; n |= *s++ & 0xFF;
-        case 2: n <<= 8; n |= *s++ & 0xFF;
-        case 1: n <<= 8; n |= *s++ & 0xFF;
-        }
-    }
-    else {
-        switch (wide) {
-        default: return 0;
-        case 4: n |= (*s++ & 0xFF) << 24;
-        case 3: n |= (*s++ & 0xFF) << 16;
-        case 2: n |= (*s++ & 0xFF) <<  8;
-        case 1: n |= (*s++ & 0xFF);
-        }
+/* the wides 1, 2, 4 and 8 are loaded by one (maybe unaligned) memory
+ * access and a byte swap if the endian is not native, memcpy() with a
+ * constant size is compiled to a single load/store */
+
+static uint64_t read_uint(const char *s, int bigendian, size_t wide) {
+    int swap = bigendian != LB_BIGENDIAN;
+    uint64_t n = 0;
+    switch (wide) {
+    case 1: return (unsigned char)*s;
+    case 2: { uint16_t n16; memcpy(&n16, s, 2);
+              return swap ? bswap16(n16) : n16; }
+    case 4: { uint32_t n32; memcpy(&n32, s, 4);
+              return swap ? bswap32(n32) : n32; }
+    case 8: memcpy(&n, s, 8);
+            return swap ? bswap64(n) : n;
     }
+    if (bigendian)
+        while (wide--) n = n << 8 | (unsigned char)*s++;
+    else
+        while (wide--) n = n << 8 | (unsigned char)s[wide];
     return n;
 }
 
-static void write_int32(char *s, int bigendian, uint32_t n, int wide) {
-    if (bigendian) {
-        switch (wide) {
-            default: return;
-            case 4: *s++ = (n >> 24) & 0xFF;
-            case 3: *s++ = (n >> 16) & 0xFF;
-            case 2: *s++ = (n >>  8) & 0xFF;
-            case 1: *s++ = (n      ) & 0xFF;
-        }
-    }
-    else {
-        switch (wide) {
-            default: return;
-            case 4: *s++ = n & 0xFF; n >>= 8;
-            case 3: *s++ = n & 0xFF; n >>= 8;
-            case 2: *s++ = n & 0xFF; n >>= 8;
-            case 1: *s++ = n & 0xFF;
-        }
+static void write_uint(char *s, int bigendian, uint64_t n, size_t wide) {
+    int swap = bigendian != LB_BIGENDIAN;
+    switch (wide) {
+    case 1: *s = (char)n; return;
+    case 2: { uint16_t n16 = (uint16_t)n;
+              if (swap) n16 = bswap16(n16);
+              memcpy(s, &n16, 2); return; }
+    case 4: { uint32_t n32 = (uint32_t)n;
+              if (swap) n32 = bswap32(n32);
+              memcpy(s, &n32, 4); return; }
+    case 8: if (swap) n = bswap64(n);
+            memcpy(s, &n, 8); return;
     }
+    if (bigendian)
+        while (wide--) { s[wide] = (char)(n & 0xFF); n >>= 8; }
+    else
+        while (wide--) { *s++ = (char)(n & 0xFF); n >>= 8; }
 }
 
-static void read_binary(const char *str, int bigendian, numcast_t *buf, size_t wide) {
-    if (wide <= 4)
-        buf->i32 = read_int32(str, bigendian, wide);
-    else if (bigendian) {
-        buf->i64 = read_int32(str, bigendian, 4); buf->i64 <<= ((wide-4)<<3);
-        buf->i64 |= read_int32(&str[4], bigendian, wide - 4);
-    }
-    else {
-        buf->i64 = read_int32(str, bigendian, 4);
-        buf->i64 |= (uint64_t)read_int32(str, bigendian, 4) << 32;
-    }
+static lua_Integer expand_sign(uint64_t n, size_t wide) {
+    if (wide < 8 && (n >> ((wide<<3) - 1) & 1) != 0)
+        n |= ~(uint64_t)0 << (wide<<3);
+    return (lua_Integer)(int64_t)n;
 }
 
-static void write_binary(char *str, int bigendian, numcast_t *buf, size_t wide) {
-    if (wide <= 4)
-        write_int32(str, bigendian, buf->i32, wide);
-    else if (bigendian) {
-        write_int32(str, bigendian, (uint32_t)(buf->i64 >> 32), wide - 4);
-        write_int32(&str[wide - 4], bigendian, (uint32_t)buf->i64, 4);
-    }
-    else {
-        write_int32(str, bigendian, (uint32_t)buf->i64, 4);
-        write_int32(&str[4], bigendian, (uint32_t)(buf->i64 >> 32), wide - 4);
+static uint64_t float_bits(lua_Number n, size_t wide) {
+    numcast_t buff;
+    if (wide <= 4) {
+        buff.f = (float)n;
+        return buff.i32;
     }
+    buff.d = (double)n;
+    return buff.i64;
 }
 
-static void expand_sign(numcast_t *buf, size_t wide) {
-    int shift = wide<<3;
+static lua_Number bits_float(uint64_t n, size_t wide) {
+    numcast_t buff;
     if (wide <= 4) {
-        if (wide != 4 && ((uint32_t)1 << (shift - 1) & buf->i32) != 0)
-            buf->i32 |= ~(uint32_t)0 << shift;
-    }
-    else {
-        if (wide != 8 && ((uint64_t)1 << (shift - 1) & buf->i64) != 0)
-            buf->i64 |= ~(uint64_t)0 << shift;
+        buff.i32 = (uint32_t)n;
+        return (lua_Number)buff.f;
     }
+    buff.i64 = n;
+    return (lua_Number)buff.d;
 }
 
 LB_API int lb_packint(lb_Buffer *B, size_t wide, int bigendian, lua_Integer i) {
-    numcast_t buff;
-    /* we use int64_t with i64, because if we use uint64_t, the
-     * high 32 bit of 64bit integer will be stripped, don't know
-     * why it happened.  */
-    if (wide <= 4)
-        buff.i32 = (/*u*/int32_t)i;
-    else
-        buff.i64 = (/*u*/int64_t)i;
-    write_binary(lb_prepbuffsize(B, wide),
-            bigendian, &buff, wide);
+    write_uint(lb_prepbuffsize(B, wide), bigendian, (uint64_t)i, wide);
     lb_addsize(B, wide);
     return wide;
 }
 
 LB_API int lb_packfloat(lb_Buffer *B, size_t wide, int bigendian, lua_Number n) {
-    numcast_t buff;
-    if (wide <= 4)
-        buff.f = (float)n;
-    else
-        buff.d = (double)n;
-    write_binary(lb_prepbuffsize(B, wide),
-            bigendian, &buff, wide);
+    write_uint(lb_prepbuffsize(B, wide), bigendian, float_bits(n, wide), wide);
     lb_addsize(B, wide);
     return wide;
 }
 
 LB_API int lb_unpackint(const char *s, size_t wide, int bigendian, lua_Integer *pi) {
-    numcast_t buff;
-    read_binary(s, bigendian, &buff, wide);
-    expand_sign(&buff, wide);
-    if (wide <= 4)
-        *pi = (lua_Integer)buff.i32;
-    else
-        *pi = (lua_Integer)buff.i64;
+    *pi = expand_sign(read_uint(s, bigendian, wide), wide);
     return wide;
 }
 
 LB_API int lb_unpackuint(const char *s, size_t wide, int bigendian, lua_Integer *pi) {
-    numcast_t buff;
-    read_binary(s, bigendian, &buff, wide);
-    if (wide <= 4)
-        *pi = (lua_Integer)buff.i32;
-    else
-        *pi = (lua_Integer)buff.i64;
+    *pi = (lua_Integer)read_uint(s, bigendian, wide);
     return wide;
 }
 
 LB_API int lb_unpackfloat(const char *s, size_t wide, int bigendian, lua_Number *pn) {
-    numcast_t buff;
-    read_binary(s, bigendian, &buff, wide);
-    if (wide <= 4)
-        *pn = (lua_Number)buff.f;
-    else
-        *pn = (lua_Number)buff.d;
+    *pn = bits_float(read_uint(s, bigendian, wide), wide);
     return wide;
 }
 
+/* variable length integers (LEB128): 7 bits a byte, low bits first,
+ * the high bit of a byte is set if more bytes follow. fmt is 'v'
+ * (unsigned), 'w' (zigzag signed, like protobuf) or 'l' (signed
+ * LEB128, sign extended from the last byte) */
+
+#define LB_VARINTMAX 10
+
+static int ctz64(uint64_t n) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(n);
+#else
+    int i = 0;
+    while ((n & 1) == 0) n >>= 1, ++i;
+    return i;
+#endif
+}
+
+LB_API int lb_packvarint(lb_Buffer *B, int fmt, lua_Integer i) {
+    uint64_t n = (uint64_t)i;
+    char buff[LB_VARINTMAX];
+    int len = 0;
+    if (fmt == 'l') {
+        uint64_t sign = (uint64_t)0 - (n >> 63);
+        /* stop when the rest bits all equal the sign bit of byte */
+        while ((n >> 6 ^ sign) & (~(uint64_t)0 >> 6)) {
+            buff[len++] = (char)(n | 0x80);
+            n = n >> 7 | (sign << 57);
+        }
+        buff[len++] = (char)(n & 0x7F);
+    }
+    else {
+        if (fmt == 'w') n = n << 1 ^ ((uint64_t)0 - (n >> 63));
+        while (n >= 0x80) {
+            buff[len++] = (char)(n | 0x80);
+            n >>= 7;
+        }
+        buff[len++] = (char)n;
+    }
+    lb_addlstring(B, buff, len);
+    return len;
+}
+
+LB_API size_t lb_unpackvarint(const char *s, size_t len, int fmt, lua_Integer *pi) {
+    uint64_t n = 0;
+    size_t i = 0;
+    if (len >= 8) {
+        /* find the last byte and gather the 7 bits groups of a 8 bytes
+         * word without loop */
+        uint64_t w = read_uint(s, 0, 8);
+        uint64_t stop = ~w & 0x8080808080808080ULL;
+        if (stop != 0) {
+            i = (size_t)(ctz64(stop) >> 3) + 1;
+            w &= (stop ^ (stop - 1)) & 0x7F7F7F7F7F7F7F7FULL;
+            w = (w & 0x007F007F007F007FULL) | (w & 0x7F007F007F007F00ULL) >> 1;
+            w = (w & 0x00003FFF00003FFFULL) | (w & 0x3FFF00003FFF0000ULL) >> 2;
+            n = (w & 0x000000000FFFFFFFULL) | (w & 0x0FFFFFFF00000000ULL) >> 4;
+            goto done;
+        }
+    }
+    while (i < len && i < LB_VARINTMAX) {
+        int c = (unsigned char)s[i];
+        n |= (uint64_t)(c & 0x7F) << (7 * i);
+        ++i;
+        if ((c & 0x80) == 0) goto done;
+    }
+    return 0; /* incomplete, or longer than LB_VARINTMAX bytes */
+done:
+    if (fmt == 'w')
+        n = n >> 1 ^ ((uint64_t)0 - (n & 1));
+    else if (fmt == 'l' && i < LB_VARINTMAX && (n >> (7 * i - 1) & 1) != 0)
+        n |= ~(uint64_t)0 << (7 * i);
+    *pi = (lua_Integer)n;
+    return i;
+}
+
+/* the array loops are expanded for every wide, so the codecs above
+ * are inlined with a constant wide */
+
+#define ARRAY_WIDES(loop, conv) \
+    loop(1, conv); loop(2, conv); loop(3, conv); loop(4, conv); \
+    loop(5, conv); loop(6, conv); loop(7, conv); loop(8, conv)
+
+LB_API void lb_unpackarray(lua_State *L, const char *s, size_t n, int fmt, size_t wide, int bigendian) {
+    size_t i;
+#define UNPACK_LOOP(w, conv) case w: \
+    for (i = 0; i < n; ++i, s += w) { \
+        uint64_t v = read_uint(s, bigendian, w); \
+        conv(v, w); lua_rawseti(L, -2, (int)i + 1); } break
+#define PUSH_INT(v, w)   lua_pushinteger(L, expand_sign(v, w))
+#define PUSH_UINT(v, w)  lua_pushinteger(L, (lua_Integer)v)
+#define PUSH_FLOAT(v, w) lua_pushnumber(L, bits_float(v, w))
+    lua_createtable(L, n > 0xFFFFFF ? 0 : (int)n, 0);
+    switch (fmt) {
+    case 'f': switch (wide) {
+                  UNPACK_LOOP(4, PUSH_FLOAT);
+                  UNPACK_LOOP(8, PUSH_FLOAT);
+              } break;
+    case 'u': switch (wide) { ARRAY_WIDES(UNPACK_LOOP, PUSH_UINT); } break;
+    default:  switch (wide) { ARRAY_WIDES(UNPACK_LOOP, PUSH_INT); } break;
+    }
+#undef PUSH_FLOAT
+#undef PUSH_UINT
+#undef PUSH_INT
+#undef UNPACK_LOOP
+}
+
+static lua_Number array_number(lua_State *L, int i) {
+    lua_Number n = lua_tonumber(L, -1);
+    if (n == 0 && !lua_isnumber(L, -1))
+        luaL_error(L, "number expected in [%d], got %s",
+                i, luaL_typename(L, -1));
+    return n;
+}
+
+static lua_Integer array_integer(lua_State *L, int i) {
+    lua_Integer n = lua_tointeger(L, -1);
+    if (n == 0 && !lua_isnumber(L, -1))
+        luaL_error(L, "number expected in [%d], got %s",
+                i, luaL_typename(L, -1));
+    return n;
+}
+
+LB_API size_t lb_packarray(lb_Buffer *B, int idx, int i, int j, int fmt, size_t wide, int bigendian) {
+    lua_State *L = B->L;
+    size_t n = i <= j ? (size_t)j - i + 1 : 0;
+    char *s;
+    int k;
+#define PACK_LOOP(w, conv) case w: \
+    for (k = i; k <= j; ++k, s += w) { \
+        lua_rawgeti(L, idx, k); \
+        write_uint(s, bigendian, conv(k, w), w); \
+        lua_pop(L, 1); } break
+#define TO_INT(k, w)   (uint64_t)array_integer(L, k)
+#define TO_FLOAT(k, w) float_bits(array_number(L, k), w)
+    if (n == 0) return 0;
+    if (n > MAX_SIZE_T / wide)
+        luaL_error(L, "array too big");
+    s = lb_prepbuffsize(B, n * wide);
+    switch (fmt) {
+    case 'f': switch (wide) {
+                  PACK_LOOP(4, TO_FLOAT);
+                  PACK_LOOP(8, TO_FLOAT);
+              } break;
+    default:  switch (wide) { ARRAY_WIDES(PACK_LOOP, TO_INT); } break;
+    }
+    lb_addsize(B, n * wide);
+    return n * wide;
+#undef TO_FLOAT
+#undef TO_INT
+#undef PACK_LOOP
+}
+
+#undef ARRAY_WIDES
+
+
+/* hash of bytes, a port of wyhash (final version 4), bytes are read in
+ * little endian, so hashes are the same on all platforms */
+
+#define WY_P0 0x2d358dccaa6c78a5ull
+#define WY_P1 0x8bb84b93962eacc9ull
+#define WY_P2 0x4b33a62ed433d4a3ull
+#define WY_P3 0x4d5a2da51de1aa47ull
+
+static void wy_mum(uint64_t *a, uint64_t *b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 u128;
+    u128 r = (u128)*a * *b;
+    *a = (uint64_t)r, *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32;
+    uint64_t la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl, lo;
+    lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo, *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static uint64_t wy_mix(uint64_t a, uint64_t b) {
+    wy_mum(&a, &b);
+    return a ^ b;
+}
+
+#define wy_r8(p) read_uint((const char*)(p), 0, 8)
+#define wy_r4(p) read_uint((const char*)(p), 0, 4)
+
+LB_API lua_Integer lb_hash(const char *s, size_t len, lua_Integer seed) {
+    const unsigned char *p = (const unsigned char*)s;
+    uint64_t sd = (uint64_t)seed, a, b;
+    sd ^= wy_mix(sd ^ WY_P0, WY_P1);
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t k = (len >> 3) << 2;
+            a = wy_r4(p) << 32 | wy_r4(p + k);
+            b = wy_r4(p + len - 4) << 32 | wy_r4(p + len - 4 - k);
+        }
+        else if (len > 0) {
+            a = (uint64_t)p[0] << 16 | (uint64_t)p[len >> 1] << 8 | p[len - 1];
+            b = 0;
+        }
+        else a = b = 0;
+    }
+    else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t s1 = sd, s2 = sd;
+            do {
+                sd = wy_mix(wy_r8(p) ^ WY_P1, wy_r8(p + 8) ^ sd);
+                s1 = wy_mix(wy_r8(p + 16) ^ WY_P2, wy_r8(p + 24) ^ s1);
+                s2 = wy_mix(wy_r8(p + 32) ^ WY_P3, wy_r8(p + 40) ^ s2);
+                p += 48, i -= 48;
+            } while (i > 48);
+            sd ^= s1 ^ s2;
+        }
+        for (; i > 16; p += 16, i -= 16)
+            sd = wy_mix(wy_r8(p) ^ WY_P1, wy_r8(p + 8) ^ sd);
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+    a ^= WY_P1, b ^= sd;
+    wy_mum(&a, &b);
+    return (lua_Integer)wy_mix(a ^ WY_P0 ^ len, b ^ WY_P1);
+}
+
+
+/* string intern cache: a direct mapped table of recently pushed
+ * strings, indexed by their hashes, so pushing the same bytes again
+ * gets the cached string without creating it by Lua.  short strings
+ * are interned by Lua itself cheaper than a lookup of cache, so they
+ * are never cached */
+
+#define LB_INTERNKEY  0xF7B2FFE9
+#ifndef LB_INTERNMIN
+#  define LB_INTERNMIN 40   /* LUAI_MAXSHORTLEN of Lua 5.3 */
+#endif
+#ifndef LB_INTERNMAX
+#  define LB_INTERNMAX 4096 /* longer strings are not cached */
+#endif
+
+typedef struct lb_Intern {
+    size_t mask;        /* number of slots - 1 */
+    size_t hits, misses;
+    uint64_t hashes[1]; /* hash of string in slot, 0 if empty */
+} lb_Intern;
+
+LB_API const char *lb_pushintern(lua_State *L, const char *s, size_t len) {
+    lb_Intern *I;
+    uint64_t h;
+    size_t slot, l;
+    const char *cs;
+    if (len <= LB_INTERNMIN || len > LB_INTERNMAX) {
+        lua_pushlstring(L, s, len);
+        return lua_tostring(L, -1);
+    }
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LB_INTERNKEY);
+    if ((I = (lb_Intern*)lua_touserdata(L, -1)) == NULL) {
+        lua_pop(L, 1);
+        lua_pushlstring(L, s, len);
+        return lua_tostring(L, -1);
+    }
+    h = (uint64_t)lb_hash(s, len, 0) | 1;
+    slot = (size_t)h & I->mask;
+    lua_getuservalue(L, -1); /* cached strings */
+    if (I->hashes[slot] == h) {
+        lua_rawgeti(L, -1, (int)slot + 1);
+        cs = lua_tolstring(L, -1, &l);
+        if (l == len && memcmp(cs, s, len) == 0) {
+            I->hits += 1;
+            lua_replace(L, -3);
+            lua_pop(L, 1);
+            return cs;
+        }
+        lua_pop(L, 1);
+    }
+    I->misses += 1;
+    lua_pushlstring(L, s, len);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, (int)slot + 1);
+    I->hashes[slot] = h;
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return lua_tostring(L, -1);
+}
+
+LB_API void lb_setinternsize(lua_State *L, size_t slots) {
+    lb_Intern *I;
+    size_t n = 1;
+    if (slots == 0) {
+        lua_pushnil(L);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LB_INTERNKEY);
+        return;
+    }
+    while (n < slots && n < ((size_t)1 << 24))
+        n <<= 1;
+    I = (lb_Intern*)lua_newuserdata(L, sizeof(lb_Intern) + (n - 1) * sizeof(uint64_t));
+    memset(I, 0, sizeof(lb_Intern) + (n - 1) * sizeof(uint64_t));
+    I->mask = n - 1;
+    lua_createtable(L, (int)n, 0);
+    lua_setuservalue(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, (void*)LB_INTERNKEY);
+}
+
+LB_API void lb_pushinterninfo(lua_State *L) {
+    lb_Intern *I;
+    lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LB_INTERNKEY);
+    I = (lb_Intern*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    lua_createtable(L, 0, 5);
+    lua_pushinteger(L, I ? (lua_Integer)I->mask + 1 : 0);
+    lua_setfield(L, -2, "slots");
+    lua_pushinteger(L, I ? I->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, I ? I->misses : 0);
+    lua_setfield(L, -2, "misses");
+    lua_pushinteger(L, LB_INTERNMIN + 1);
+    lua_setfield(L, -2, "minlen");
+    lua_pushinteger(L, LB_INTERNMAX);
+    lua_setfield(L, -2, "maxlen");
+}
+
 /*
  * cc: lua='lua53' flags+='-s -O2 -Wall -std=c99 -pedantic -mdll -Id:/$lua/include' libs+='d:/$lua/$lua.dll'
  * cc: flags+='-DLB_REDIR_STRLIB=1 -DLB_FILEHANDLE'
@@ -20,6 +20,16 @@
 # define LB_API LUA_API
 #endif
 
+/* inline capacity of buffer objects created by lb_newbuffer() */
+#ifndef LB_INLINESIZE
+# define LB_INLINESIZE 32
+#endif
+
+/* increment of LB_GROWFIXED growth policy */
+#ifndef LB_GROWSTEP
+# define LB_GROWSTEP (1024*1024)
+#endif
+
 /* compatible apis */
 #if LUA_VERSION_NUM < 502
 #  define LUA_OK                        0
@@ -40,16 +50,41 @@ LUALIB_API const char *luaL_tolstring (lua_State *L, int idx, size_t *plen);
 #endif /* LUA_VERSION_NUM < 502 */
 
 
-/* luaL_Buffer compatible interface */
+/* luaL_Buffer compatible interface
+ * NOTE: like luaL_Buffer, a lb_Buffer initialized by lb_buffinit()
+ * pushes a box on the stack when it outgrows initb, the box owns the
+ * storage until lb_pushresult() or lb_resetbuffer(), so a error raised
+ * meanwhile does not leak it.  stack use between buffer operations must
+ * be balanced, and lb_pushresult() removes the box.  */
 
 typedef struct lb_Buffer {
     char *b;
     size_t size;
     size_t n;
     lua_State *L;
-    char initb[LUAL_BUFFERSIZE];
+    unsigned int flags; /* see LB_* flags below */
+    unsigned int subs;  /* number of sub buffers alias the storage */
+    size_t gap;         /* position of the gap, if LB_GAPOPEN */
+    size_t head;        /* bytes consumed from front, storage is b-head */
+    void *box;          /* box on stack owns storage, see lb_buffinit() */
+    char initb[LUAL_BUFFERSIZE]; /* only LB_INLINESIZE in LB_SMALL */
 } lb_Buffer;
 
+#define LB_SMALL  0x01 /* object layout, initb has LB_INLINESIZE bytes */
+#define LB_POOLED 0x08 /* storage comes from/goes back to storage pool */
+#define LB_VIEW   0x10 /* sub buffer, b points into storage of parent */
+#define LB_GAP    0x20 /* gap mode, edits keep a gap at the edit point */
+#define LB_GAPOPEN 0x40 /* gap is open, content after it is at the end */
+#define LB_MAPPED 0x80 /* storage is a memory mapped file */
+#define LB_READONLY 0x100 /* content must not be changed */
+#define LB_ONSTACK 0x200 /* initialized by lb_buffinit(), uses a box */
+
+/* growth policies */
+#define LB_GROWDOUBLE 0x00 /* double the capacity (default) */
+#define LB_GROWHALF   0x02 /* grow capacity by half */
+#define LB_GROWFIXED  0x04 /* double until LB_GROWSTEP, then add it */
+#define LB_GROWMASK   0x06
+
 #define lb_buffinitsize(L,B,sz) (lb_buffinit((L),(B)),lb_prepbuffsize((B),(sz)))
 #define lb_addsize(B,s)	 ((B)->n += (s))
 #define lb_prepbuffer(B)  lb_prepbuffsize((B), LUAL_BUFFERSIZE)
@@ -74,6 +109,52 @@ LB_API void  lb_addvalue     (lb_Buffer *B);
 LB_API void  lb_pushresult   (lb_Buffer *B);
 
 
+/* capacity management */
+
+#define lb_capacity(B) ((B)->size + (B)->head)
+
+LB_API char *lb_reservebuffer (lb_Buffer *B, size_t cap);
+LB_API void  lb_shrinkbuffer  (lb_Buffer *B);
+LB_API void  lb_setgrowth     (lb_Buffer *B, unsigned int policy);
+
+/* removes sz bytes from the front of B without moving the rest, the
+ * space is reused when lb_prepbuffsize() needs room */
+LB_API void  lb_consume       (lb_Buffer *B, size_t sz);
+
+/* gap mode: opengap moves the gap to pos and makes it at least sz
+ * bytes, returns it; content after the gap is kept at the end of
+ * storage until closegap.  lb_testbuffer() closes the gap, so buffers
+ * got from it always have contiguous content */
+LB_API char *lb_opengap  (lb_Buffer *B, size_t pos, size_t sz);
+LB_API void  lb_closegap (lb_Buffer *B);
+
+
+/* storage pool of buffer objects */
+
+LB_API void lb_setpoollimit (lua_State *L, size_t limit);
+LB_API void lb_pushpoolinfo (lua_State *L);
+
+
+/* string intern cache: pushintern pushes a string like lua_pushlstring,
+ * but returns the cached one if the same bytes were pushed recently and
+ * the cache is enabled by setinternsize (0 disables it).  hash returns
+ * a 64-bit (wyhash) hash of bytes. */
+
+LB_API const char *lb_pushintern     (lua_State *L, const char *s, size_t len);
+LB_API void        lb_setinternsize  (lua_State *L, size_t slots);
+LB_API void        lb_pushinterninfo (lua_State *L);
+LB_API lua_Integer lb_hash           (const char *s, size_t len, lua_Integer seed);
+
+
+/* memory mapped files: maps file at path into a new buffer object,
+ * read-only, or private copy-on-write if writable is true.  the content
+ * moves to heap storage when the buffer grows, and the file is unmapped
+ * when the buffer is reset or collected.  returns NULL and sets errno
+ * on error. */
+
+LB_API lb_Buffer *lb_mapfile (lua_State *L, const char *path, int writable);
+
+
 /* buffer type routines */
 
 #define LB_METAKEY 0xF7B2FFE7
@@ -88,6 +169,12 @@ LB_API lb_Buffer *lb_testbuffer  (lua_State *L, int idx);
 LB_API lb_Buffer *lb_checkbuffer (lua_State *L, int idx);
 LB_API lb_Buffer *lb_pushbuffer  (lua_State *L, const char *str, size_t len);
 
+/* sub buffers alias a range of a buffer, the storage of that buffer is
+ * pinned (can not be moved or freed) while sub buffers are attached */
+LB_API lb_Buffer *lb_subbuffer     (lua_State *L, int narg, size_t pos, size_t len);
+LB_API lb_Buffer *lb_parentbuffer  (lua_State *L, int narg);
+LB_API void       lb_releasebuffer (lua_State *L, int narg);
+
 LB_API int          lb_isbufferorstring (lua_State *L, int idx);
 LB_API const char  *lb_tolstring        (lua_State *L, int idx, size_t *plen);
 LB_API const char  *lb_checklstring     (lua_State *L, int idx, size_t *plen);
@@ -103,6 +190,16 @@ LB_API int lb_unpackuint (const char *s, size_t wide, int bigendian, lua_Integer
 LB_API int lb_packfloat   (lb_Buffer *B, size_t wide, int bigendian, lua_Number n);
 LB_API int lb_unpackfloat (const char *s, size_t wide, int bigendian, lua_Number *pn);
 
+/* fmt is 'v' (unsigned varint), 'w' (zigzag varint) or 'l' (signed
+ * LEB128), unpackvarint returns 0 if s ends before the varint */
+LB_API int    lb_packvarint   (lb_Buffer *B, int fmt, lua_Integer i);
+LB_API size_t lb_unpackvarint (const char *s, size_t len, int fmt, lua_Integer *pi);
+
+/* fmt is 'i', 'u' or 'f', unpackarray pushes a table with n numbers
+ * read from s, packarray appends numbers in idx[i..j] to B */
+LB_API void   lb_unpackarray (lua_State *L, const char *s, size_t n, int fmt, size_t wide, int bigendian);
+LB_API size_t lb_packarray   (lb_Buffer *B, int idx, int i, int j, int fmt, size_t wide, int bigendian);
+
 LB_API int lb_pack   (lb_Buffer *B, const char *fmt, int args);
 LB_API int lb_unpack (lua_State *L, const char *s, size_t n, const char *fmt);
 
@@ -1,3 +1,7 @@
+#if !defined(_WIN32) && !defined(_XOPEN_SOURCE)
+#  define _XOPEN_SOURCE 600 /* for fileno() and IOV_MAX under -std=c99 */
+#endif
+
 #define LUA_LIB
 #include "lbuffer.h"
 #include "lualib.h" /* for LUA_FILEHANDLE */
@@ -5,7 +9,54 @@
 
 #include <stdarg.h>
 #include <ctype.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef S_ISREG
+#  define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+
+#ifndef _MSC_VER
+#  include <stdint.h>
+#else
+#  define uint32_t unsigned long
+#  define uint64_t unsigned __int64
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#  include <limits.h>
+#  include <unistd.h>
+#  include <sys/uio.h>
+#  define LB_POSIX
+#  if defined(IOV_MAX) && IOV_MAX < 64
+#    define LB_IOVMAX IOV_MAX
+#  else
+#    define LB_IOVMAX 64
+#  endif
+#endif
+
+/* size of stack area readfd() reads overflowed data into */
+#ifndef LB_SPILLSIZE
+#  define LB_SPILLSIZE 16384
+#endif
+
+#if !defined(LB_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#  include <emmintrin.h>
+#  define LB_SSE2
+#endif
+
+#if defined(LB_SSE2) && defined(__SSE4_2__)
+#  include <nmmintrin.h>
+#  define LB_SSE42
+#  if defined(__PCLMUL__) && defined(__x86_64__)
+#    include <wmmintrin.h>
+#    define LB_PCLMUL
+#  endif
+#endif
 
 
 #ifdef LB_REPLACE_LUA_API
@@ -41,6 +92,40 @@ static int type_error(lua_State *L, int narg, const char *tname) {
     return luaL_argerror(L, narg, msg);
 }
 
+static lb_Buffer *check_gapbuffer(lua_State *L, int idx) {
+    /* like lb_checkbuffer(), but keeps the gap of buffer in gap mode
+     * open, for functions that edit the buffer around the gap */
+    lb_Buffer *B = (lb_Buffer*)lua_touserdata(L, idx);
+    if (B != NULL && lua_getmetatable(L, idx)) {
+        lua_rawgetp(L, LUA_REGISTRYINDEX, (void*)LB_METAKEY);
+        if (!lua_rawequal(L, -1, -2))
+            B = NULL;
+        lua_pop(L, 2);
+        if (B != NULL) {
+            B->L = L;
+            if (B->subs != 0) /* sub buffers must not see the gap */
+                lb_closegap(B);
+            return B;
+        }
+    }
+    type_error(L, idx, LB_LIBNAME);
+    return NULL;
+}
+
+static lb_Buffer *writable(lua_State *L, lb_Buffer *B) {
+    /* B will be changed in place */
+    if (B->flags & LB_READONLY)
+        luaL_error(L, "attempt to change a read-only buffer");
+    return B;
+}
+
+/* edits keep a gap, unless sub buffers refer to the content */
+#define gap_edit(B) (((B)->flags & LB_GAP) && (B)->subs == 0)
+
+/* address of char at pos, which may be after the gap */
+#define gap_at(B, pos) (((B)->flags & LB_GAPOPEN) && (pos) >= (B)->gap ? \
+        &(B)->b[(B)->size - ((B)->n - (pos))] : &(B)->b[pos])
+
 
 /* buffer information */
 
@@ -53,36 +138,141 @@ static int L__tostring(lua_State *L) {
     if ((B = lb_testbuffer(L, 1)) == NULL)
         luaL_tolstring(L, 1, NULL);
     else
-        lua_pushlstring(L, B->b, B->n);
+        lb_pushintern(L, B->b, B->n);
     return 1;
 }
 
+static char *hex_encode(char *d, const char *s, size_t n, int upper) {
+    const char *hexa = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+#ifdef LB_SSE2
+    /* 16 bytes a time: split nibbles, map 0-9/10-15 to ascii, and
+     * interleave high and low nibbles */
+    const __m128i mask = _mm_set1_epi8(0x0F), nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i alpha = _mm_set1_epi8((upper ? 'A' : 'a') - '0' - 10);
+    for (; n >= 16; n -= 16, s += 16, d += 32) {
+        __m128i v = _mm_loadu_si128((const __m128i*)s);
+        __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+        __m128i lo = _mm_and_si128(v, mask);
+        hi = _mm_add_epi8(_mm_add_epi8(hi, zero),
+                _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+        lo = _mm_add_epi8(_mm_add_epi8(lo, zero),
+                _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+        _mm_storeu_si128((__m128i*)d, _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(d + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; n > 0; --n, ++s) {
+        *d++ = hexa[uchar(*s) >> 4];
+        *d++ = hexa[uchar(*s) & 0xF];
+    }
+    return d;
+}
+
+static char *hex_encodesep(char *d, const char *s, size_t n, int upper,
+                           const char *sep, size_t seplen) {
+    if (seplen == 0)
+        return hex_encode(d, s, n, upper);
+    for (; n > 0; --n, ++s) {
+        d = hex_encode(d, s, 1, upper);
+        if (n == 1) break;
+        if (seplen == 1)
+            *d++ = *sep;
+        else {
+            memcpy(d, sep, seplen);
+            d += seplen;
+        }
+    }
+    return d;
+}
+
 static int Ltohex(lua_State *L) {
     lb_Buffer B;
-    size_t i, len, seplen, gseplen = 0;
+    size_t i, len, seplen, gseplen = 0, ngroups, total;
     const char *str = lb_tolstring(L, 1, &len);
     const char *sep, *gsep = NULL;
-    int upper, group = -1, col = 0;
-    int has_group = lua_type(L, 2) == LUA_TNUMBER, arg = 2;
+    lua_Integer group = 0;
+    int upper, has_group = lua_type(L, 2) == LUA_TNUMBER, arg = 2;
+    char *d;
     if (has_group) group = lua_tointeger(L, arg++);
-    if (group == 0) group = -1;
+    if (group < 0) group = 0;
     sep = lb_optlstring(L, arg++, "", &seplen);
     if (has_group) gsep = lb_optlstring(L, arg++, "\n", &gseplen);
     upper = lua_toboolean(L, arg++);
+    if (len == 0) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    /* compute the result size, and write it in one pass */
+    ngroups = group != 0 ? (len - 1) / (size_t)group : 0;
+    if (len > (~(size_t)0) / (2 + seplen + gseplen))
+        luaL_error(L, "resulting string too large");
+    total = len * 2 + ngroups * gseplen + (len - 1 - ngroups) * seplen;
     lb_buffinit(L, &B);
-    for (i = 0; i < len; ++i, ++col) {
-        char *hexa = upper ? "0123456789ABCDEF" : "0123456789abcdef";
-        if (col == group)
-            col = 0, lb_addlstring(&B, gsep, gseplen);
-        else if (i != 0)
-            lb_addlstring(&B, sep, seplen);
-        lb_addchar(&B, hexa[uchar(str[i]) >> 4]);
-        lb_addchar(&B, hexa[uchar(str[i]) & 0xF]);
+    d = lb_prepbuffsize(&B, total);
+    for (i = 0; i < len; i += (size_t)group) {
+        size_t n = group == 0 || len - i < (size_t)group ?
+            len - i : (size_t)group;
+        if (i != 0) {
+            memcpy(d, gsep, gseplen);
+            d += gseplen;
+        }
+        d = hex_encodesep(d, &str[i], n, upper, sep, seplen);
+        if (group == 0) break;
     }
+    lb_addsize(&B, total);
     lb_pushresult(&B);
     return 1;
 }
 
+static int hexdigit(int ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    ch |= 0x20; /* to lower case */
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    return -1;
+}
+
+static size_t hex_decode(char *d, const char *s, size_t len, size_t *perr) {
+    /* decode s to d (can be same as s), spaces and punctuations
+     * between bytes are skipped, *perr is the offset of the first
+     * invalid char, or len */
+    size_t i = 0, n = 0;
+    while (i < len) {
+        int hi = hexdigit(uchar(s[i])), lo;
+        if (hi < 0) {
+            if (!isspace(uchar(s[i])) && !ispunct(uchar(s[i])))
+                break;
+            ++i;
+            continue;
+        }
+        if (i + 1 >= len || (lo = hexdigit(uchar(s[i + 1]))) < 0)
+            break;
+        d[n++] = (char)(hi << 4 | lo);
+        i += 2;
+    }
+    *perr = i;
+    return n;
+}
+
+static int Lfromhex(lua_State *L) {
+    /* b:fromhex([s]), decode b in place, or append decoded s to b */
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
+    size_t len, err;
+    if (lua_isnoneornil(L, 2) || lb_testbuffer(L, 2) == B) {
+        len = B->n;
+        B->n = hex_decode(B->b, B->b, len, &err);
+    }
+    else {
+        const char *s = lb_checklstring(L, 2, &len);
+        char *d = lb_prepbuffsize(B, len / 2);
+        lb_addsize(B, hex_decode(d, s, len, &err));
+    }
+    lua_settop(L, 1);
+    if (err == len) return 1;
+    lua_pushinteger(L, err + 1);
+    return 2;
+}
+
 static int Lquote(lua_State *L) {
     size_t i, len;
     const char *str = lb_tolstring(L, 1, &len);
@@ -164,7 +354,7 @@ static int Lipairs(lua_State *L) {
 }
 
 static int Lsetlen(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     int newlen = lua_tointeger(L, 2);
     if (newlen < 0) newlen += B->n;
     if (newlen < 0) newlen = 0;
@@ -175,13 +365,128 @@ static int Lsetlen(lua_State *L) {
     return_self(L);
 }
 
+static int Lcapacity(lua_State *L) {
+    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lua_pushinteger(L, lb_capacity(B));
+    return 1;
+}
+
 static int Llen(lua_State *L) {
     size_t len;
-    lb_checklstring(L, 1, &len);
+    if (lua_type(L, 1) == LUA_TUSERDATA)
+        len = check_gapbuffer(L, 1)->n;
+    else
+        lb_checklstring(L, 1, &len);
     lua_pushinteger(L, len);
     return 1;
 }
 
+static int Lreserve(lua_State *L) {
+    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lua_Integer cap = luaL_checkinteger(L, 2);
+    if (cap > 0) lb_reservebuffer(B, (size_t)cap);
+    return_self(L);
+}
+
+static int Lshrink(lua_State *L) {
+    lb_shrinkbuffer(lb_checkbuffer(L, 1));
+    return_self(L);
+}
+
+static int Lgrowth(lua_State *L) {
+    static const char *const opts[] = { "double", "half", "fixed", NULL };
+    static const unsigned int policies[] = {
+        LB_GROWDOUBLE, LB_GROWHALF, LB_GROWFIXED
+    };
+    lb_Buffer *B = lb_checkbuffer(L, 1);
+    if (lua_isnoneornil(L, 2)) {
+        int i = 2;
+        while (i > 0 && (B->flags & LB_GROWMASK) != policies[i])
+            --i;
+        lua_pushstring(L, opts[i]);
+        return 1;
+    }
+    lb_setgrowth(B, policies[luaL_checkoption(L, 2, NULL, opts)]);
+    return_self(L);
+}
+
+static int Lmode(lua_State *L) {
+    static const char *const opts[] = { "normal", "gap", NULL };
+    lb_Buffer *B = lb_checkbuffer(L, 1); /* gap is closed */
+    if (lua_isnoneornil(L, 2)) {
+        lua_pushstring(L, opts[(B->flags & LB_GAP) != 0]);
+        return 1;
+    }
+    if (luaL_checkoption(L, 2, NULL, opts) == 1)
+        B->flags |= LB_GAP;
+    else
+        B->flags &= ~LB_GAP;
+    return_self(L);
+}
+
+static int Lpool(lua_State *L) {
+    if (lua_type(L, 1) == LUA_TBOOLEAN && !lua_toboolean(L, 1))
+        lb_setpoollimit(L, 0);
+    else if (!lua_isnoneornil(L, 1)) {
+        lua_Integer limit = luaL_checkinteger(L, 1);
+        lb_setpoollimit(L, limit > 0 ? (size_t)limit : 0);
+    }
+    lb_pushpoolinfo(L);
+    return 1;
+}
+
+static int Lhash(lua_State *L) {
+    /* b:hash([i[, j[, seed]]]) */
+    size_t len;
+    const char *s = lb_checklstring(L, 1, &len);
+    lua_Integer h;
+    s += rangerelat(L, 2, &len);
+    h = lb_hash(s, len, luaL_optinteger(L, 4, 0));
+#if LUA_VERSION_NUM < 503
+    h &= ((lua_Integer)1 << 53) - 1; /* keep it exact in a double */
+#endif
+    lua_pushinteger(L, h);
+    return 1;
+}
+
+static int Lintern(lua_State *L) {
+    if (lua_type(L, 1) == LUA_TBOOLEAN && !lua_toboolean(L, 1))
+        lb_setinternsize(L, 0);
+    else if (!lua_isnoneornil(L, 1)) {
+        lua_Integer slots = luaL_checkinteger(L, 1);
+        lb_setinternsize(L, slots > 0 ? (size_t)slots : 0);
+    }
+    lb_pushinterninfo(L);
+    return 1;
+}
+
+static int Lsub(lua_State *L) {
+    lb_Buffer *B = lb_checkbuffer(L, 1);
+    size_t len = B->n, pos = rangerelat(L, 2, &len);
+    lb_subbuffer(L, 1, pos, len);
+    return 1;
+}
+
+static int Lsubcount(lua_State *L) {
+    lua_pushinteger(L, lb_checkbuffer(L, 1)->subs);
+    return 1;
+}
+
+static int Loffset(lua_State *L) {
+    /* returns position of sub buffer in parent, and the parent */
+    lb_Buffer *B = lb_checkbuffer(L, 1), *P;
+    if ((P = lb_parentbuffer(L, 1)) == NULL)
+        return 0;
+    lua_pushinteger(L, B->b - P->b + 1);
+    lua_insert(L, -2);
+    return 2;
+}
+
+static int Lrelease(lua_State *L) {
+    lb_releasebuffer(L, 1);
+    return_self(L);
+}
+
 static int Lbyte(lua_State *L) {
     lb_Buffer *B = lb_checkbuffer(L, 1);
     size_t i, len = B->n, pos = rangerelat(L, 2, &len);
@@ -202,6 +507,8 @@ static int Lchar(lua_State *L) {
         invalid = -1;
         n += 1;
     }
+    else
+        writable(L, B);
     p = lb_prepbuffsize(B, n);
     for (i = 2; i <= n; ++i) {
         int c = (int)luaL_checkinteger(L, i);
@@ -235,8 +542,79 @@ static void* testudata(lua_State *L, int narg, const char *tname) {
     return NULL;  /* value is not a userdata with a metatable */
 }
 
+static FILE *tofile(lua_State *L, int narg) {
+    /* FILE* of a opened Lua file handle, or NULL */
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream *p = (luaL_Stream*)testudata(L, narg, LUA_FILEHANDLE);
+    return p != NULL && p->closef != NULL ? p->f : NULL;
+#else
+    FILE **pf = (FILE**)testudata(L, narg, LUA_FILEHANDLE);
+    return pf != NULL ? *pf : NULL;
+#endif
+}
+
+static size_t file_remains(FILE *f) {
+    /* bytes from current position to end of a regular file, or 0 */
+#ifdef LB_POSIX
+    struct stat st;
+    long pos;
+    if (fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode)
+            || (pos = ftell(f)) < 0 || (lua_Number)pos > (lua_Number)st.st_size)
+        return 0;
+    return (size_t)(st.st_size - pos);
+#else
+    (void)f;
+    return 0; /* size unknown, read in chunks */
+#endif
+}
+
+static char *file_prep(lb_Buffer *B, size_t pos, size_t n) {
+    /* room for n bytes at pos, B->n is kept if growing raises */
+    if (n > (size_t)(~(size_t)0) - pos)
+        luaL_error(B->L, "buffer too large");
+    if (pos + n > B->n)
+        lb_prepbuffsize(B, pos + n - B->n);
+    return &B->b[pos];
+}
+
+static size_t file_read(lb_Buffer *B, size_t pos, FILE *f, size_t n, int all) {
+    /* reads n bytes (or all rest bytes) of f into B at pos, overwrites
+     * bytes after pos */
+    size_t got, total = 0;
+    if (!all) {
+        total = fread(file_prep(B, pos, n), 1, n, f);
+        if (pos + total > B->n) B->n = pos + total;
+        return total;
+    }
+    if ((n = file_remains(f)) != 0) { /* read the known size at once */
+        int ch;
+        total = fread(file_prep(B, pos, n), 1, n, f);
+        if (pos + total > B->n) B->n = pos + total;
+        if (total < n || (ch = getc(f)) == EOF)
+            return total;
+        ungetc(ch, f); /* file grew */
+    }
+    n = LUAL_BUFFERSIZE;
+    do {
+        got = fread(file_prep(B, pos + total, n), 1, n, f);
+        total += got;
+        if (pos + total > B->n) B->n = pos + total;
+        if (n < ((size_t)1 << 20)) n *= 2;
+    } while (got != 0);
+    return total;
+}
+
 static const char *readfile(lua_State *L, int narg, size_t *plen) {
     /* narg must absolute index */
+    FILE *f;
+    if (lua_gettop(L) == narg && (f = tofile(L, narg)) != NULL) {
+        /* read rest of file to a temporary buffer directly */
+        lb_Buffer *B = lb_newbuffer(L);
+        file_read(B, 0, f, 0, 1);
+        lua_replace(L, narg);
+        if (plen != NULL) *plen = B->n;
+        return B->b;
+    }
     if (testudata(L, narg, LUA_FILEHANDLE) != NULL) {
         int top = lua_gettop(L);
         lua_getfield(L, narg, "read");
@@ -318,6 +696,17 @@ static const char *check_strarg(lua_State *L, int idx,
     return NULL;
 }
 
+static const char *unalias(lb_Buffer *B, const char *s, size_t len) {
+    /* the storage of B may be moved or shifted while modifying, so
+     * copy a source overlaps it (e.g. a sub buffer) to a temporary
+     * string first */
+    if (s != NULL && s < B->b + B->size && s + len > B->b) {
+        lua_pushlstring(B->L, s, len);
+        return lua_tostring(B->L, -1);
+    }
+    return s;
+}
+
 static void apply_strarg(lb_Buffer *B, size_t pos,
         const char *s, size_t len, size_t padlen) {
     if (pos + len > B->size)
@@ -342,37 +731,134 @@ static int Lnew(lua_State *L) {
     size_t padlen, len;
     const char *s = check_strarg(L, 1, &len, &padlen);
     B = lb_newbuffer(L);
+    lb_prepbuffsize(B, len + 1);
     apply_strarg(B, 0, s, len, padlen);
     B->b[len] = '\0';
     lb_addsize(B, len);
     return 1;
 }
 
-static int map_char(lua_State *L, int (*f)(int)) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+static int c_locale(void) {
+    /* ASCII case mapping is only correct in the C locale */
+    const char *l = setlocale(LC_CTYPE, NULL);
+    return l == NULL || strcmp(l, "C") == 0 || strcmp(l, "POSIX") == 0;
+}
+
+static int ascii_case(int ch, int upper) {
+    if ((unsigned)(ch - (upper ? 'a' : 'A')) < 26u)
+        return ch ^ 0x20;
+    return ch;
+}
+
+#ifdef LB_SSE2
+static __m128i ascii_case16(__m128i v, int upper) {
+    /* bytes >= 0x80 are negative, so they are never in range */
+    __m128i first = _mm_set1_epi8(upper ? 'a' - 1 : 'A' - 1);
+    __m128i last = _mm_set1_epi8(upper ? 'z' + 1 : 'Z' + 1);
+    __m128i in = _mm_and_si128(_mm_cmpgt_epi8(v, first),
+                               _mm_cmplt_epi8(v, last));
+    return _mm_xor_si128(v, _mm_and_si128(in, _mm_set1_epi8(0x20)));
+}
+#endif
+
+static void case_map(char *s, size_t n, int upper) {
+    size_t i = 0;
+    if (!c_locale()) {
+        for (; i < n; ++i)
+            s[i] = (char)(upper ? toupper(uchar(s[i])) : tolower(uchar(s[i])));
+        return;
+    }
+#ifdef LB_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)&s[i]);
+        _mm_storeu_si128((__m128i*)&s[i], ascii_case16(v, upper));
+    }
+#endif
+    for (; i < n; ++i)
+        s[i] = (char)ascii_case(uchar(s[i]), upper);
+}
+
+static int case_cmp(const char *s1, const char *s2, size_t n) {
+    /* compare as lower case, returns the difference of first
+     * different bytes */
+    size_t i = 0;
+    if (!c_locale()) {
+        for (; i < n; ++i) {
+            int a = tolower(uchar(s1[i])), b = tolower(uchar(s2[i]));
+            if (a != b) return a - b;
+        }
+        return 0;
+    }
+#ifdef LB_SSE2
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s1[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&s2[i]);
+        a = ascii_case16(a, 0), b = ascii_case16(b, 0);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF)
+            break; /* find the different byte below */
+    }
+#endif
+    for (; i < n; ++i) {
+        int a = ascii_case(uchar(s1[i]), 0), b = ascii_case(uchar(s2[i]), 0);
+        if (a != b) return a - b;
+    }
+    return 0;
+}
+
+static int map_char(lua_State *L, int upper) {
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     size_t first = posrelat(luaL_optinteger(L, 2, 1), B->n);
     size_t last = posrelat(luaL_optinteger(L, 3, -1), B->n);
-    for (; first <= last; ++first)
-        B->b[first] = uchar(f(B->b[first]));
+    if (last >= B->n) last = B->n - 1;
+    if (B->n != 0 && first <= last)
+        case_map(&B->b[first], last - first + 1, upper);
     return_self(L);
 }
 
-static int Llower(lua_State *L) { return map_char(L, tolower); }
-static int Lupper(lua_State *L) { return map_char(L, toupper); }
+static int Llower(lua_State *L) { return map_char(L, 0); }
+static int Lupper(lua_State *L) { return map_char(L, 1); }
+
+static int Licmp(lua_State *L) {
+    size_t l1, l2;
+    const char *s1 = lb_checklstring(L, 1, &l1);
+    const char *s2 = lb_checklstring(L, 2, &l2);
+    int res;
+    if ((res = case_cmp(s1, s2, l1 < l2 ? l1 : l2)) == 0)
+        res = l1 < l2 ? -1 : l1 > l2;
+    lua_pushinteger(L, res > 0 ? 1 : res < 0 ? -1 : 0);
+    return 1;
+}
+
+static int Lieq(lua_State *L) {
+    size_t l1, l2;
+    const char *s1 = lb_checklstring(L, 1, &l1);
+    const char *s2 = lb_checklstring(L, 2, &l2);
+    lua_pushboolean(L, l1 == l2 && case_cmp(s1, s2, l1) == 0);
+    return 1;
+}
 
 static int Linsert(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, check_gapbuffer(L, 1));
     size_t len, padlen, pos = B->n;
     const char *s;
     if (lua_type(L, 2) != LUA_TNUMBER) { /* append */
         s = check_strarg(L, 2, &len, &padlen);
+        s = unalias(B, s, padlen ? padlen : len);
+        lb_closegap(B);
         apply_strarg(B, pos, s, len, padlen);
         lb_addsize(B, len);
     }
     else { /* insert */
         pos = posrelat(lua_tointeger(L, 2), B->n);
         s = check_strarg(L, 3, &len, &padlen);
-        if (len != 0) {
+        s = unalias(B, s, padlen ? padlen : len);
+        if (len != 0 && gap_edit(B)) { /* write into gap */
+            lb_opengap(B, pos, len);
+            apply_strarg(B, pos, s, len, padlen);
+            B->gap += len;
+            lb_addsize(B, len);
+        }
+        else if (len != 0) {
             lb_prepbuffsize(B, len);
             memmove(&B->b[pos+len], &B->b[pos], B->n-pos);
             apply_strarg(B, pos, s, len, padlen);
@@ -383,7 +869,7 @@ static int Linsert(lua_State *L) {
 }
 
 static int Lclear(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     size_t padlen, len = B->n, pos = rangerelat(L, 2, &len);
     const char *s = luaL_optlstring(L, 4, NULL, &padlen);
     apply_strarg(B, pos, s, len, padlen);
@@ -391,17 +877,19 @@ static int Lclear(lua_State *L) {
 }
 
 static int Lset(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     size_t len, padlen, pos;
     const char *s;
     if (lua_type(L, 2) != LUA_TNUMBER) { /* assign */
         s = check_strarg(L, 2, &len, &padlen);
+        s = unalias(B, s, padlen ? padlen : len);
         apply_strarg(B, 0, s, len, padlen);
         B->n = len;
     }
     else { /* overwrite */
         pos = posrelat(lua_tointeger(L, 2), B->n);
         s = check_strarg(L, 3, &len, &padlen);
+        s = unalias(B, s, padlen ? padlen : len);
         apply_strarg(B, pos, s, len, padlen);
         if (B->n < pos + len)
             B->n = pos + len;
@@ -410,7 +898,7 @@ static int Lset(lua_State *L) {
 }
 
 static int Lrep(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     size_t len = B->n;
     const char *str = B->b;
     lua_Integer rep = 0;
@@ -420,6 +908,7 @@ static int Lrep(lua_State *L) {
         rep = luaL_checkinteger(L, 3);
     else type_error(L, 2, "number/buffer/string");
     if (rep < 0) rep = 0;
+    if (len*rep > B->size) str = unalias(B, str, len);
     apply_strarg(B, 0, str, len*rep, len);
     B->n = len*rep;
     return_self(L);
@@ -433,7 +922,7 @@ static int Lcopy(lua_State *L) {
 }
 
 static int Lmove(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     lua_Integer dst = luaL_checkinteger(L, 2);
     size_t len = B->n, pos = rangerelat(L, 3, &len);
 
@@ -452,10 +941,16 @@ static int Lmove(lua_State *L) {
 }
 
 static int Lremove(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, check_gapbuffer(L, 1));
     size_t len = B->n, pos = rangerelat(L, 2, &len);
     size_t end = pos + len;
-    if (len != 0)
+    if (len != 0 && gap_edit(B))
+        lb_opengap(B, pos, 0); /* drop the head of content after gap */
+    else if (pos == 0) { /* consume from front */
+        lb_consume(B, len);
+        return_self(L);
+    }
+    else if (len != 0)
         memmove(&B->b[pos], &B->b[end], B->n - end);
     B->n -= len;
     return_self(L);
@@ -470,7 +965,7 @@ static void my_strrev(char *p1, char *p2) {
 }
 
 static int Lreverse(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     size_t len = B->n, pos = rangerelat(L, 2, &len);
     my_strrev(&B->b[pos], &B->b[pos + len]);
     return_self(L);
@@ -491,7 +986,7 @@ static void exchange_split(char *p1, char *p2, char *p3, char *p4) {
 
 static int Lswap(lua_State *L) {
     size_t p1, l1, p2, l2;
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
     if (lua_isnoneornil(L, 3)) {
         p2 = posrelat(luaL_checkinteger(L, 2), B->n);
         l2 = B->n - p2;
@@ -521,53 +1016,1828 @@ static int Lswap(lua_State *L) {
 }
 
 
-/* bianry operations */
+/* file I/O */
 
-static size_t check_giargs(lua_State *L, int narg, size_t len, size_t *wide, int *bigendian) {
-    size_t pos = posrelat(luaL_optinteger(L, narg, 1), len);
-    *wide = (size_t)luaL_optinteger(L, narg + 1, 4);
-    if (*wide < 1 || *wide > 8)
-        luaL_argerror(L, narg + 1, "only 1 to 8 wide support");
-    switch (*luaL_optlstring(L, narg + 2, "native", NULL)) {
-    case 'b': case 'B': case '>': *bigendian = 1; break;
-    case 'l': case 'L': case '<': *bigendian = 0; break;
-    case 'n': case 'N': case '=': *bigendian = LB_BIGENDIAN; break;
-    default: luaL_argerror(L, 4, "only \"big\" or \"little\" or \"native\" endian support");
+static int file_error(lua_State *L, const char *fname, int en) {
+    lua_pushnil(L);
+    if (fname != NULL)
+        lua_pushfstring(L, "%s: %s", fname, strerror(en));
+    else
+        lua_pushstring(L, strerror(en));
+    lua_pushinteger(L, en);
+    return 3;
+}
+
+static FILE *check_file(lua_State *L, int narg) {
+    FILE *f = tofile(L, narg);
+    if (f == NULL) {
+        if (testudata(L, narg, LUA_FILEHANDLE) != NULL)
+            luaL_error(L, "attempt to use a closed file");
+        type_error(L, narg, "file");
     }
-    return pos;
+    return f;
 }
 
-static int Lgetint(lua_State *L) {
-    lua_Integer i;
-    size_t len;
-    const char *str = lb_checklstring(L, 1, &len);
-    int bigendian;
-    size_t wide, pos = check_giargs(L, 2, len, &wide, &bigendian);
-    if (pos + wide > len) return 0;
-    lb_unpackint(&str[pos], wide, bigendian, &i);
-    lua_pushinteger(L, i);
+static int check_fd(lua_State *L, int narg) {
+#ifdef LB_POSIX
+    lua_Integer fd = luaL_checkinteger(L, narg);
+    luaL_argcheck(L, fd >= 0 && fd <= INT_MAX, narg, "invalid file descriptor");
+    return (int)fd;
+#else
+    return luaL_error(L, "file descriptors are not supported");
+#endif
+}
+
+static int write_error(lua_State *L, int en, size_t written) {
+    /* nil, message, errno and bytes written before error */
+    file_error(L, NULL, en);
+    lua_pushinteger(L, written);
+    return 4;
+}
+
+#ifdef LB_POSIX
+static size_t fd_write(int fd, const char *s, size_t len, int *perr) {
+    /* writes all bytes, unless a error occurs */
+    size_t total = 0;
+    *perr = 0;
+    while (total < len) {
+        ssize_t n = write(fd, s + total, len - total);
+        if (n == 0 || (n < 0 && errno != EINTR)) {
+            *perr = n == 0 ? EIO : errno;
+            break;
+        }
+        if (n > 0) total += (size_t)n;
+    }
+    return total;
+}
+#endif
+
+static int Lfileno(lua_State *L) {
+#ifdef LB_POSIX
+    lua_pushinteger(L, fileno(check_file(L, 1)));
     return 1;
+#else
+    check_file(L, 1);
+    return luaL_error(L, "file descriptors are not supported");
+#endif
 }
 
-static int Lgetuint(lua_State *L) {
-    lua_Integer i;
-    size_t len;
-    const char *str = lb_checklstring(L, 1, &len);
-    int bigendian;
-    size_t wide, pos = check_giargs(L, 2, len, &wide, &bigendian);
-    if (pos + wide > len) return 0;
-    lb_unpackuint(&str[pos], wide, bigendian, &i);
-    lua_pushinteger(L, i);
+static int Lreadfrom(lua_State *L) {
+    /* b:readfrom([pos, ]fh[, n]) */
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
+    size_t got, pos = B->n;
+    int narg = 2;
+    lua_Integer n;
+    FILE *f;
+    if (lua_type(L, 2) == LUA_TNUMBER)
+        pos = posrelat(lua_tointeger(L, narg++), B->n);
+    f = check_file(L, narg);
+    n = luaL_optinteger(L, narg + 1, -1);
+    clearerr(f);
+    got = file_read(B, pos, f, n > 0 ? (size_t)n : 0, n < 0);
+    if (got == 0 && ferror(f))
+        return file_error(L, NULL, errno);
+    lua_settop(L, 1);
+    lua_pushinteger(L, got);
+    return 2;
+}
+
+#define LB_FILE LB_LIBNAME ".file"
+
+static int Lfile_gc(lua_State *L) {
+    FILE **pf = (FILE**)luaL_checkudata(L, 1, LB_FILE);
+    if (*pf != NULL) {
+        fclose(*pf);
+        *pf = NULL;
+    }
+    return 0;
+}
+
+static int Lload(lua_State *L) {
+    /* buffer.load(path) */
+    const char *fname = luaL_checkstring(L, 1);
+    /* the handle is closed by __gc if reading raises a error */
+    FILE **pf = (FILE**)lua_newuserdata(L, sizeof(FILE*));
+    lb_Buffer *B;
+    int err = 0;
+    *pf = NULL;
+    luaL_getmetatable(L, LB_FILE);
+    lua_setmetatable(L, -2);
+    if ((*pf = fopen(fname, "rb")) == NULL)
+        return file_error(L, fname, errno);
+    B = lb_newbuffer(L);
+    file_read(B, 0, *pf, 0, 1);
+    if (ferror(*pf)) err = errno;
+    fclose(*pf);
+    *pf = NULL;
+    if (err != 0)
+        return file_error(L, fname, err);
     return 1;
 }
 
-static int Lsetuint(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
-    lua_Integer i = luaL_checkinteger(L, 2);
-    int bigendian;
-    size_t wide, pos = check_giargs(L, 3, B->n, &wide, &bigendian);
-    lb_atpos(B, pos, lb_packint(B, wide, bigendian, i));
+static int Lwriteto(lua_State *L) {
+    /* b:writeto(fh|fd[, i[, j]]) */
+    size_t len, written;
+    const char *s = lb_checklstring(L, 1, &len);
+    int en = 0;
+    s += rangerelat(L, 3, &len);
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+#ifdef LB_POSIX
+        written = fd_write(check_fd(L, 2), s, len, &en);
+#else
+        written = check_fd(L, 2);
+#endif
+    }
+    else {
+        FILE *f = check_file(L, 2);
+        errno = 0;
+        if ((written = fwrite(s, 1, len, f)) < len)
+            en = errno != 0 ? errno : EIO;
+    }
+    if (en != 0)
+        return write_error(L, en, written);
     lua_settop(L, 1);
+    lua_pushinteger(L, written);
+    return 2;
+}
+
+static const char *check_item(lua_State *L, int narg, int i, size_t *plen) {
+    /* pushes item i of table, numbers are converted to string, so the
+     * item must stay on stack as long as the result is used */
+    const char *s;
+    lua_rawgeti(L, narg, i);
+    if ((s = lb_tolstring(L, -1, plen)) == NULL)
+        luaL_error(L, "buffer/string expected in [%d], got %s",
+                i, luaL_typename(L, -1));
+    return s;
+}
+
+static int Lwritev(lua_State *L) {
+    /* buffer.writev(fh|fd, { s1, s2, ... }) */
+    int i, n;
+    size_t total = 0;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 2);
+    if (lua_type(L, 1) != LUA_TNUMBER) {
+        FILE *f = check_file(L, 1);
+        errno = 0;
+        for (i = 1; i <= n; ++i) {
+            size_t len, written;
+            const char *s = check_item(L, 2, i, &len);
+            total += written = fwrite(s, 1, len, f);
+            lua_pop(L, 1); /* pop item */
+            if (written < len)
+                return write_error(L, errno != 0 ? errno : EIO, total);
+        }
+    }
+    else {
+#ifdef LB_POSIX
+        int fd = check_fd(L, 1);
+        struct iovec iov[LB_IOVMAX];
+        luaL_checkstack(L, LB_IOVMAX, "too many items");
+        for (i = 1; i <= n; ) {
+            int k = 0, count = 0;
+            for (; count < LB_IOVMAX && i + count <= n; ++count) {
+                size_t len;
+                iov[count].iov_base = (void*)check_item(L, 2, i + count, &len);
+                iov[count].iov_len = len;
+            }
+            while (k < count) { /* write until all of batch is done */
+                ssize_t w = writev(fd, &iov[k], count - k);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w < 0 || (w == 0 && iov[k].iov_len != 0))
+                    return write_error(L, w < 0 ? errno : EIO, total);
+                total += (size_t)w;
+                for (; k < count && (size_t)w >= iov[k].iov_len; ++k)
+                    w -= iov[k].iov_len;
+                if (k < count) { /* partial written */
+                    iov[k].iov_base = (char*)iov[k].iov_base + w;
+                    iov[k].iov_len -= w;
+                }
+            }
+            lua_pop(L, count); /* pop items of batch */
+            i += count;
+        }
+#else
+        check_fd(L, 1);
+#endif
+    }
+    lua_pushinteger(L, total);
+    return 1;
+}
+
+#ifdef LB_POSIX
+static int fd_result(lua_State *L, ssize_t n, int en) {
+    /* b and n, or false if operation would block, or nil on error */
+    if (n >= 0) {
+        lua_settop(L, 1);
+        lua_pushinteger(L, (lua_Integer)n);
+        return 2;
+    }
+    file_error(L, NULL, en);
+    if (en == EAGAIN || en == EWOULDBLOCK) {
+        lua_pushboolean(L, 0);
+        lua_replace(L, -4);
+    }
+    return 3;
+}
+#endif
+
+static int Lreadfd(lua_State *L) {
+    /* b:readfd(fd[, maxbytes]) */
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
+#ifdef LB_POSIX
+    int fd = check_fd(L, 2);
+    lua_Integer max = luaL_optinteger(L, 3, 0);
+    ssize_t n;
+    if (max > 0) {
+        char *p = lb_prepbuffsize(B, (size_t)max);
+        while ((n = read(fd, p, (size_t)max)) < 0 && errno == EINTR)
+            ;
+        if (n > 0) lb_addsize(B, (size_t)n);
+    }
+    else { /* read into free space of buffer, and spill the rest */
+        char spill[LB_SPILLSIZE];
+        struct iovec iov[2];
+        iov[0].iov_base = lb_prepbuffsize(B, LUAL_BUFFERSIZE);
+        iov[0].iov_len = B->size - B->n;
+        iov[1].iov_base = spill;
+        iov[1].iov_len = sizeof(spill);
+        while ((n = readv(fd, iov, 2)) < 0 && errno == EINTR)
+            ;
+        if (n > 0 && (size_t)n <= iov[0].iov_len)
+            lb_addsize(B, (size_t)n);
+        else if (n > 0) {
+            lb_addsize(B, iov[0].iov_len);
+            lb_addlstring(B, spill, (size_t)n - iov[0].iov_len);
+        }
+    }
+    return fd_result(L, n, errno);
+#else
+    (void)B;
+    return check_fd(L, 2);
+#endif
+}
+
+static int Lwritefd(lua_State *L) {
+    /* b:writefd(fd[, i[, j]]) */
+    size_t len;
+    const char *s = lb_checklstring(L, 1, &len);
+#ifdef LB_POSIX
+    int fd = check_fd(L, 2);
+    ssize_t n;
+    s += rangerelat(L, 3, &len);
+    while ((n = write(fd, s, len)) < 0 && errno == EINTR)
+        ;
+    return fd_result(L, n, errno);
+#else
+    (void)s;
+    return check_fd(L, 2);
+#endif
+}
+
+static int Lmmap(lua_State *L) {
+    /* buffer.mmap(path[, mode]) */
+    static const char *const opts[] = { "r", "c", NULL };
+    const char *fname = luaL_checkstring(L, 1);
+    int mode = luaL_checkoption(L, 2, "r", opts);
+    if (lb_mapfile(L, fname, mode == 1) == NULL)
+        return file_error(L, fname, errno);
+    return 1;
+}
+
+
+/* bianry operations */
+
+static size_t check_giargs(lua_State *L, int narg, size_t len, size_t *wide, int *bigendian) {
+    size_t pos = posrelat(luaL_optinteger(L, narg, 1), len);
+    *wide = (size_t)luaL_optinteger(L, narg + 1, 4);
+    if (*wide < 1 || *wide > 8)
+        luaL_argerror(L, narg + 1, "only 1 to 8 wide support");
+    switch (*luaL_optlstring(L, narg + 2, "native", NULL)) {
+    case 'b': case 'B': case '>': *bigendian = 1; break;
+    case 'l': case 'L': case '<': *bigendian = 0; break;
+    case 'n': case 'N': case '=': *bigendian = LB_BIGENDIAN; break;
+    default: luaL_argerror(L, 4, "only \"big\" or \"little\" or \"native\" endian support");
+    }
+    return pos;
+}
+
+static int Lgetint(lua_State *L) {
+    lua_Integer i;
+    size_t len;
+    const char *str = lb_checklstring(L, 1, &len);
+    int bigendian;
+    size_t wide, pos = check_giargs(L, 2, len, &wide, &bigendian);
+    if (pos + wide > len) return 0;
+    lb_unpackint(&str[pos], wide, bigendian, &i);
+    lua_pushinteger(L, i);
+    return 1;
+}
+
+static int Lgetuint(lua_State *L) {
+    lua_Integer i;
+    size_t len;
+    const char *str = lb_checklstring(L, 1, &len);
+    int bigendian;
+    size_t wide, pos = check_giargs(L, 2, len, &wide, &bigendian);
+    if (pos + wide > len) return 0;
+    lb_unpackuint(&str[pos], wide, bigendian, &i);
+    lua_pushinteger(L, i);
+    return 1;
+}
+
+static int Lsetuint(lua_State *L) {
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
+    lua_Integer i = luaL_checkinteger(L, 2);
+    int bigendian;
+    size_t wide, pos = check_giargs(L, 3, B->n, &wide, &bigendian);
+    lb_atpos(B, pos, lb_packint(B, wide, bigendian, i));
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int check_arraytype(lua_State *L, int narg, size_t *wide, int *bigendian) {
+    /* type is [endian]fmt[wide][endian], e.g. "i4<", ">u2", "f8" */
+    const char *type = luaL_checkstring(L, narg);
+    int fmt;
+    *bigendian = LB_BIGENDIAN;
+    *wide = 4;
+    switch (*type) {
+    case '>': *bigendian = 1; ++type; break;
+    case '<': *bigendian = 0; ++type; break;
+    case '=': ++type; break;
+    }
+    fmt = *type++;
+    if (fmt != 'i' && fmt != 'u' && fmt != 'f')
+        luaL_argerror(L, narg, "only 'i', 'u' or 'f' array type support");
+    if (*type >= '0' && *type <= '9')
+        *wide = *type++ - '0';
+    switch (*type) {
+    case '>': *bigendian = 1; ++type; break;
+    case '<': *bigendian = 0; ++type; break;
+    case '=': *bigendian = LB_BIGENDIAN; ++type; break;
+    }
+    if (*type != '\0')
+        luaL_argerror(L, narg, "invalid array type");
+    if (fmt == 'f' ? *wide != 4 && *wide != 8 : *wide < 1 || *wide > 8)
+        luaL_argerror(L, narg, fmt == 'f' ? "only 4 or 8 wide support"
+                                          : "only 1 to 8 wide support");
+    return fmt;
+}
+
+static int Lgetarray(lua_State *L) {
+    /* b:getarray([pos, ]type[, n]) */
+    size_t len, wide, n, pos = 0;
+    const char *s = lb_checklstring(L, 1, &len);
+    int narg = 2, fmt, bigendian;
+    if (lua_type(L, narg) == LUA_TNUMBER)
+        pos = posrelat(lua_tointeger(L, narg++), len);
+    fmt = check_arraytype(L, narg, &wide, &bigendian);
+    n = (len - pos) / wide;
+    if (!lua_isnoneornil(L, narg + 1)) {
+        lua_Integer count = luaL_checkinteger(L, narg + 1);
+        if (count < 0) count = 0;
+        if ((size_t)count < n) n = (size_t)count;
+    }
+    lb_unpackarray(L, &s[pos], n, fmt, wide, bigendian);
+    lua_pushinteger(L, pos + n * wide + 1);
+    return 2;
+}
+
+static int Lsetarray(lua_State *L) {
+    /* b:setarray([pos, ]type, t[, i[, j]]) */
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 1));
+    size_t wide, len = 0, pos = 0;
+    int narg = 2, fmt, bigendian, i, j;
+    if (lua_type(L, narg) == LUA_TNUMBER)
+        pos = posrelat(lua_tointeger(L, narg++), B->n);
+    fmt = check_arraytype(L, narg++, &wide, &bigendian);
+    luaL_checktype(L, narg, LUA_TTABLE);
+    i = (int)luaL_optinteger(L, narg + 1, 1);
+    j = (int)luaL_optinteger(L, narg + 2, (lua_Integer)lua_rawlen(L, narg));
+    lb_atpos(B, pos, len = lb_packarray(B, narg, i, j, fmt, wide, bigendian));
+    lua_settop(L, 1);
+    lua_pushinteger(L, pos + len + 1);
+    return 2;
+}
+
+
+/* string searching */
+
+#define SPECIALS "^$*+?.([%-"
+
+/* minimum needle length to use Boyer-Moore-Horspool, shorter needles
+ * are found by a first byte filter */
+#ifdef LB_SSE2
+#  define LB_HORSPOOLMIN 32
+#else
+#  define LB_HORSPOOLMIN 4
+#endif
+
+#ifdef LB_SSE2
+static int lb_ctz(unsigned x) {
+#if defined(__GNUC__)
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+    while ((x & 1) == 0) x >>= 1, ++n;
+    return n;
+#endif
+}
+#endif
+
+static const char *find_horspool(const char *s, const char *end,
+                                 const char *p, size_t plen) {
+    /* find p in candidates [s, end), plen should >= 2 */
+    size_t skip[256], i;
+    int last = uchar(p[plen - 1]);
+    for (i = 0; i < 256; ++i)
+        skip[i] = plen;
+    for (i = 0; i < plen - 1; ++i)
+        skip[uchar(p[i])] = plen - 1 - i;
+    while (s < end) {
+        int c = uchar(s[plen - 1]);
+        if (c == last && memcmp(s, p, plen - 1) == 0)
+            return s;
+        if ((size_t)(end - s) <= skip[c]) break;
+        s += skip[c];
+    }
+    return NULL;
+}
+
+static const char *find_plain(const char *s, size_t len,
+                              const char *p, size_t plen) {
+    const char *end;
+    if (plen == 0) return s;
+    if (plen > len) return NULL;
+    if (plen == 1) return (const char*)memchr(s, *p, len);
+    end = s + len - plen + 1; /* candidates are in [s, end) */
+    if (plen >= LB_HORSPOOLMIN && end - s >= 1024) /* skip table pays off */
+        return find_horspool(s, end, p, plen);
+#ifdef LB_SSE2
+    {   /* compare first and last bytes of 16 candidates a time */
+        __m128i first = _mm_set1_epi8(p[0]);
+        __m128i last = _mm_set1_epi8(p[plen - 1]);
+        for (; end - s >= 16; s += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)s);
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + plen - 1));
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+                        _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+            for (; mask != 0; mask &= mask - 1) {
+                const char *c = s + lb_ctz(mask);
+                if (memcmp(c + 1, p + 1, plen - 2) == 0)
+                    return c;
+            }
+        }
+    }
+#endif
+    while (s < end && (s = (const char*)memchr(s, *p, end - s)) != NULL) {
+        if (memcmp(s + 1, p + 1, plen - 1) == 0)
+            return s;
+        ++s;
+    }
+    return NULL;
+}
+
+static int nospecials(const char *p, size_t plen) {
+    size_t i;
+    for (i = 0; i < plen; ++i)
+        if (p[i] != '\0' && strchr(SPECIALS, p[i]) != NULL)
+            return 0;
+    return 1;
+}
+
+/* the pattern matcher below is ported from lstrlib.c of Lua 5.3, it
+ * reads the subject from buffer memory directly, so it never reads
+ * the byte after the subject (buffers have no terminating zero).
+ * patterns and replacement strings are always Lua strings. */
+
+#define LB_MAXCAPTURES  32
+#define LB_MAXCCALLS    200
+#define CAP_UNFINISHED  (-1)
+#define CAP_POSITION    (-2)
+#define L_ESC           '%'
+
+/* Lua 5.3 and later never match a empty string right after the
+ * previous match in gsub and gmatch */
+#ifndef LB_LASTMATCH
+#  define LB_LASTMATCH (LUA_VERSION_NUM >= 503)
+#endif
+
+typedef struct MatchState {
+    const char *src_init; /* init of source string */
+    const char *src_end;  /* end ('\0') of source string */
+    const char *p_end;    /* end ('\0') of pattern */
+    lua_State *L;
+    int matchdepth;       /* control for recursive depth */
+    int offsets;          /* push captures as offsets */
+    lb_Buffer *B;         /* source buffer, may be changed by callbacks */
+    int level;            /* total number of captures */
+    struct {
+        const char *init;
+        ptrdiff_t len;
+    } capture[LB_MAXCAPTURES];
+} MatchState;
+
+static const char *match(MatchState *ms, const char *s, const char *p);
+
+static int check_capture(MatchState *ms, int l) {
+    l -= '1';
+    if (l < 0 || l >= ms->level || ms->capture[l].len == CAP_UNFINISHED)
+        return luaL_error(ms->L, "invalid capture index %%%d", l + 1);
+    return l;
+}
+
+static int capture_to_close(MatchState *ms) {
+    int level = ms->level;
+    for (level--; level >= 0; level--)
+        if (ms->capture[level].len == CAP_UNFINISHED) return level;
+    return luaL_error(ms->L, "invalid pattern capture");
+}
+
+static const char *classend(MatchState *ms, const char *p) {
+    switch (*p++) {
+    case L_ESC:
+        if (p == ms->p_end)
+            luaL_error(ms->L, "malformed pattern (ends with '%%')");
+        return p + 1;
+    case '[':
+        if (*p == '^') p++;
+        do { /* look for a ']' */
+            if (p == ms->p_end)
+                luaL_error(ms->L, "malformed pattern (missing ']')");
+            if (*(p++) == L_ESC && p < ms->p_end)
+                p++; /* skip escapes (e.g. '%]') */
+        } while (*p != ']');
+        return p + 1;
+    default:
+        return p;
+    }
+}
+
+static int match_class(int c, int cl) {
+    int res;
+    switch (tolower(cl)) {
+    case 'a': res = isalpha(c); break;
+    case 'c': res = iscntrl(c); break;
+    case 'd': res = isdigit(c); break;
+    case 'g': res = isgraph(c); break;
+    case 'l': res = islower(c); break;
+    case 'p': res = ispunct(c); break;
+    case 's': res = isspace(c); break;
+    case 'u': res = isupper(c); break;
+    case 'w': res = isalnum(c); break;
+    case 'x': res = isxdigit(c); break;
+    case 'z': res = (c == 0); break; /* deprecated option */
+    default: return (cl == c);
+    }
+    return isupper(cl) ? !res : res;
+}
+
+static int matchbracketclass(int c, const char *p, const char *ec) {
+    int sig = 1;
+    if (*(p + 1) == '^') {
+        sig = 0;
+        p++; /* skip the '^' */
+    }
+    while (++p < ec) {
+        if (*p == L_ESC) {
+            p++;
+            if (match_class(c, uchar(*p)))
+                return sig;
+        }
+        else if (*(p + 1) == '-' && (p + 2 < ec)) {
+            p += 2;
+            if (uchar(*(p - 2)) <= c && c <= uchar(*p))
+                return sig;
+        }
+        else if (uchar(*p) == c) return sig;
+    }
+    return !sig;
+}
+
+static int singlematch(MatchState *ms, const char *s, const char *p,
+                       const char *ep) {
+    int c;
+    if (s >= ms->src_end)
+        return 0;
+    c = uchar(*s);
+    switch (*p) {
+    case '.': return 1; /* matches any char */
+    case L_ESC: return match_class(c, uchar(*(p + 1)));
+    case '[': return matchbracketclass(c, p, ep - 1);
+    default:  return (uchar(*p) == c);
+    }
+}
+
+static const char *matchbalance(MatchState *ms, const char *s,
+                                const char *p) {
+    int b, e, cont = 1;
+    if (p >= ms->p_end - 1)
+        luaL_error(ms->L, "malformed pattern (missing arguments to '%%b')");
+    if (s >= ms->src_end || *s != *p) return NULL;
+    b = *p, e = *(p + 1);
+    while (++s < ms->src_end) {
+        if (*s == e) {
+            if (--cont == 0) return s + 1;
+        }
+        else if (*s == b) cont++;
+    }
+    return NULL; /* string ends out of balance */
+}
+
+static const char *max_expand(MatchState *ms, const char *s,
+                              const char *p, const char *ep) {
+    ptrdiff_t i = 0; /* counts maximum expand for item */
+    while (singlematch(ms, s + i, p, ep))
+        i++;
+    /* keeps trying to match with the maximum repetitions */
+    while (i >= 0) {
+        const char *res = match(ms, (s + i), ep + 1);
+        if (res) return res;
+        i--; /* else didn't match; reduce 1 repetition to try again */
+    }
+    return NULL;
+}
+
+static const char *min_expand(MatchState *ms, const char *s,
+                              const char *p, const char *ep) {
+    for (;;) {
+        const char *res = match(ms, s, ep + 1);
+        if (res != NULL)
+            return res;
+        else if (singlematch(ms, s, p, ep))
+            s++; /* try with one more repetition */
+        else return NULL;
+    }
+}
+
+static const char *start_capture(MatchState *ms, const char *s,
+                                 const char *p, int what) {
+    const char *res;
+    int level = ms->level;
+    if (level >= LB_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+    ms->capture[level].init = s;
+    ms->capture[level].len = what;
+    ms->level = level + 1;
+    if ((res = match(ms, s, p)) == NULL) /* match failed? */
+        ms->level--; /* undo capture */
+    return res;
+}
+
+static const char *end_capture(MatchState *ms, const char *s,
+                               const char *p) {
+    int l = capture_to_close(ms);
+    const char *res;
+    ms->capture[l].len = s - ms->capture[l].init; /* close capture */
+    if ((res = match(ms, s, p)) == NULL) /* match failed? */
+        ms->capture[l].len = CAP_UNFINISHED; /* undo capture */
+    return res;
+}
+
+static const char *match_capture(MatchState *ms, const char *s, int l) {
+    size_t len;
+    l = check_capture(ms, l);
+    len = ms->capture[l].len;
+    if ((size_t)(ms->src_end - s) >= len &&
+            memcmp(ms->capture[l].init, s, len) == 0)
+        return s + len;
+    return NULL;
+}
+
+static const char *match(MatchState *ms, const char *s, const char *p) {
+    if (ms->matchdepth-- == 0)
+        luaL_error(ms->L, "pattern too complex");
+init: /* using goto's to optimize tail recursion */
+    if (p != ms->p_end) { /* end of pattern? */
+        switch (*p) {
+        case '(': /* start capture */
+            if (*(p + 1) == ')') /* position capture? */
+                s = start_capture(ms, s, p + 2, CAP_POSITION);
+            else
+                s = start_capture(ms, s, p + 1, CAP_UNFINISHED);
+            break;
+        case ')': /* end capture */
+            s = end_capture(ms, s, p + 1);
+            break;
+        case '$':
+            if ((p + 1) != ms->p_end) /* is the '$' the last char? */
+                goto dflt; /* no; go to default */
+            s = (s == ms->src_end) ? s : NULL; /* check end of string */
+            break;
+        case L_ESC: /* escaped sequences not in the format class[*+?-]? */
+            switch (*(p + 1)) {
+            case 'b': /* balanced string? */
+                s = matchbalance(ms, s, p + 2);
+                if (s != NULL) {
+                    p += 4; goto init; /* return match(ms, s, p + 4); */
+                } /* else fail (s == NULL) */
+                break;
+            case 'f': { /* frontier? */
+                const char *ep; int previous, current;
+                p += 2;
+                if (*p != '[')
+                    luaL_error(ms->L, "missing '[' after '%%f' in pattern");
+                ep = classend(ms, p); /* points to what is next */
+                previous = (s == ms->src_init) ? '\0' : uchar(*(s - 1));
+                current = (s == ms->src_end) ? '\0' : uchar(*s);
+                if (!matchbracketclass(previous, p, ep - 1) &&
+                        matchbracketclass(current, p, ep - 1)) {
+                    p = ep; goto init; /* return match(ms, s, ep); */
+                }
+                s = NULL; /* match failed */
+                break;
+            }
+            case '0': case '1': case '2': case '3':
+            case '4': case '5': case '6': case '7':
+            case '8': case '9': /* capture results (%0-%9)? */
+                s = match_capture(ms, s, uchar(*(p + 1)));
+                if (s != NULL) {
+                    p += 2; goto init; /* return match(ms, s, p + 2) */
+                }
+                break;
+            default: goto dflt;
+            }
+            break;
+        default: dflt: { /* pattern class plus optional suffix */
+            const char *ep = classend(ms, p); /* points to optional suffix */
+            /* does not match at least once? */
+            if (!singlematch(ms, s, p, ep)) {
+                if (*ep == '*' || *ep == '?' || *ep == '-') { /* accept empty? */
+                    p = ep + 1; goto init; /* return match(ms, s, ep + 1); */
+                }
+                else /* '+' or no suffix */
+                    s = NULL; /* fail */
+            }
+            else { /* matched once */
+                switch (*ep) { /* handle optional suffix */
+                case '?': { /* optional */
+                    const char *res;
+                    if ((res = match(ms, s + 1, ep + 1)) != NULL)
+                        s = res;
+                    else {
+                        p = ep + 1; goto init; /* else return match(ms, s, ep + 1); */
+                    }
+                    break;
+                }
+                case '+': /* 1 or more repetitions */
+                    s++; /* 1 match already done */
+                    /* fall through */
+                case '*': /* 0 or more repetitions */
+                    s = max_expand(ms, s, p, ep);
+                    break;
+                case '-': /* 0 or more repetitions (minimum) */
+                    s = min_expand(ms, s, p, ep);
+                    break;
+                default: /* no suffix */
+                    s++; p = ep; goto init; /* return match(ms, s + 1, ep); */
+                }
+            }
+            break;
+        }
+        }
+    }
+    ms->matchdepth++;
+    return s;
+}
+
+static void push_onecapture(MatchState *ms, int i, const char *s,
+                            const char *e) {
+    lua_State *L = ms->L;
+    if (i >= ms->level) {
+        if (i != 0)
+            luaL_error(L, "invalid capture index %%%d", i + 1);
+        /* ms->level == 0, add whole match */
+    }
+    else {
+        ptrdiff_t l = ms->capture[i].len;
+        if (l == CAP_UNFINISHED) luaL_error(L, "unfinished capture");
+        s = ms->capture[i].init;
+        if (l == CAP_POSITION) {
+            lua_pushinteger(L, (s - ms->src_init) + 1);
+            if (ms->offsets) /* as a empty range */
+                lua_pushinteger(L, s - ms->src_init);
+            return;
+        }
+        e = s + l;
+    }
+    if (!ms->offsets)
+        lua_pushlstring(L, s, e - s);
+    else {
+        lua_pushinteger(L, (s - ms->src_init) + 1);
+        lua_pushinteger(L, e - ms->src_init);
+    }
+}
+
+static int push_captures(MatchState *ms, const char *s, const char *e) {
+    int i;
+    int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+    luaL_checkstack(ms->L, nlevels * 2, "too many captures");
+    for (i = 0; i < nlevels; i++)
+        push_onecapture(ms, i, s, e);
+    return ms->offsets ? nlevels * 2 : nlevels;
+}
+
+static void prepstate(MatchState *ms, lua_State *L, const char *s,
+                      size_t ls, const char *p, size_t lp) {
+    ms->L = L;
+    ms->matchdepth = LB_MAXCCALLS;
+    ms->offsets = 0;
+    ms->B = NULL;
+    ms->src_init = s;
+    ms->src_end = s + ls;
+    ms->p_end = p + lp;
+}
+
+#define reprepstate(ms) ((ms)->level = 0, (ms)->matchdepth = LB_MAXCCALLS)
+
+static int first_literal(const char *p, const char *p_end) {
+    /* returns the first char must be matched, or -1 */
+    if (p == p_end || (strchr(SPECIALS, *p) != NULL && *p != '\0'))
+        return -1;
+    if (p + 1 < p_end && (p[1] == '*' || p[1] == '?' || p[1] == '-'))
+        return -1;
+    return uchar(*p);
+}
+
+static const char *check_pattern(lua_State *L, int idx, size_t *plen) {
+    /* patterns are Lua strings, so the matcher can read the
+     * terminating zero */
+    if (lb_testbuffer(L, idx) != NULL) {
+        lb_Buffer *B = lb_testbuffer(L, idx);
+        lua_pushlstring(L, B->b, B->n);
+        lua_replace(L, idx);
+    }
+    return luaL_checklstring(L, idx, plen);
+}
+
+static lua_Integer check_init(lua_State *L, int idx, size_t len) {
+    /* returns 1-based init like string.find, or 0 if out of range */
+    lua_Integer init = luaL_optinteger(L, idx, 1);
+    if (init < 0)
+        init = (size_t)-init > len ? 1 : (lua_Integer)len + init + 1;
+    else if (init == 0)
+        init = 1;
+    return (size_t)init > len + 1 ? 0 : init;
+}
+
+static int str_find_aux(lua_State *L, int find) {
+    size_t ls, lp;
+    const char *s = lb_checklstring(L, 1, &ls);
+    const char *p = check_pattern(L, 2, &lp);
+    lua_Integer init = check_init(L, 3, ls);
+    if (init == 0) { /* start after string's end? */
+        lua_pushnil(L);
+        return 1;
+    }
+    if (find && (lua_toboolean(L, 4) || nospecials(p, lp))) {
+        const char *found = find_plain(&s[init - 1], ls - (size_t)init + 1,
+                                       p, lp);
+        if (found != NULL) {
+            lua_pushinteger(L, found - s + 1);
+            lua_pushinteger(L, found - s + lp);
+            return 2;
+        }
+    }
+    else {
+        MatchState ms;
+        const char *s1 = s + init - 1;
+        int anchor = (*p == '^'), first;
+        if (anchor) {
+            p++; lp--; /* skip anchor character */
+        }
+        prepstate(&ms, L, s, ls, p, lp);
+        ms.offsets = !find && lua_toboolean(L, 4);
+        first = anchor ? -1 : first_literal(p, ms.p_end);
+        do {
+            const char *res;
+            if (first >= 0 && (s1 = (const char*)memchr(s1, first,
+                            ms.src_end - s1)) == NULL)
+                break; /* skip to the first literal char */
+            reprepstate(&ms);
+            if ((res = match(&ms, s1, p)) != NULL) {
+                if (find) {
+                    lua_pushinteger(L, (s1 - s) + 1); /* start */
+                    lua_pushinteger(L, res - s); /* end */
+                    return push_captures(&ms, NULL, 0) + 2;
+                }
+                return push_captures(&ms, s1, res);
+            }
+        } while (s1++ < ms.src_end && !anchor);
+    }
+    lua_pushnil(L); /* not found */
+    return 1;
+}
+
+static int Lfind(lua_State *L) { return str_find_aux(L, 1); }
+static int Lmatch(lua_State *L) { return str_find_aux(L, 0); }
+
+static int gmatch_aux(lua_State *L) {
+    MatchState ms;
+    size_t ls, lp;
+    const char *s = lb_tolstring(L, lua_upvalueindex(1), &ls);
+    const char *p = lua_tolstring(L, lua_upvalueindex(2), &lp);
+    size_t pos = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+    const char *src;
+    if (pos > ls) return 0; /* the buffer may be changed between calls */
+    prepstate(&ms, L, s, ls, p, lp);
+    ms.offsets = lua_toboolean(L, lua_upvalueindex(4));
+    for (src = s + pos; src <= ms.src_end; src++) {
+        const char *e;
+        reprepstate(&ms);
+#if LB_LASTMATCH
+        if ((e = match(&ms, src, p)) != NULL
+                && e - s != lua_tointeger(L, lua_upvalueindex(5))) {
+            lua_pushinteger(L, e - s);
+            lua_pushvalue(L, -1);
+            lua_replace(L, lua_upvalueindex(3));
+            lua_replace(L, lua_upvalueindex(5)); /* last match */
+            return push_captures(&ms, src, e);
+        }
+#else
+        if ((e = match(&ms, src, p)) != NULL) {
+            lua_Integer newstart = e - s;
+            if (e == src) newstart++; /* empty match? go at least one position */
+            lua_pushinteger(L, newstart);
+            lua_replace(L, lua_upvalueindex(3));
+            return push_captures(&ms, src, e);
+        }
+#endif
+    }
+    return 0; /* not found */
+}
+
+static int Lgmatch(lua_State *L) {
+    /* b:gmatch(pattern[, init[, offsets]]) */
+    size_t ls, lp;
+    lua_Integer init;
+    lb_checklstring(L, 1, &ls);
+    check_pattern(L, 2, &lp);
+    init = check_init(L, 3, ls);
+    lua_settop(L, 4);
+    lua_pushinteger(L, init == 0 ? (lua_Integer)ls + 1 : init - 1);
+    lua_replace(L, 3);
+    lua_pushinteger(L, -1); /* no last match */
+    lua_pushcclosure(L, gmatch_aux, 5);
+    return 1;
+}
+
+static void sync_source(MatchState *ms, size_t end) {
+    /* source buffer may be changed by callbacks, end is the offset
+     * must be kept */
+    lb_Buffer *B = ms->B;
+    if (B != NULL && (B->b != ms->src_init
+                || B->n != (size_t)(ms->src_end - ms->src_init))) {
+        if (B->n < end)
+            luaL_error(ms->L, "source buffer changed during gsub");
+        ms->src_init = B->b;
+        ms->src_end = B->b + B->n;
+    }
+}
+
+static void add_s(MatchState *ms, lb_Buffer *B, const char *s,
+                  const char *e) {
+    size_t l, i;
+    lua_State *L = ms->L;
+    const char *news = lua_tolstring(L, 3, &l);
+    for (i = 0; i < l; i++) {
+        if (news[i] != L_ESC)
+            lb_addchar(B, news[i]);
+        else {
+            i++; /* skip ESC */
+            if (!isdigit(uchar(news[i]))) {
+                if (news[i] != L_ESC)
+                    luaL_error(L, "invalid use of '%c' in replacement string", L_ESC);
+                lb_addchar(B, news[i]);
+            }
+            else if (news[i] == '0')
+                lb_addlstring(B, s, e - s);
+            else {
+                size_t len;
+                const char *cap;
+                push_onecapture(ms, news[i] - '1', s, e);
+                cap = luaL_tolstring(L, -1, &len); /* if number, convert it to string */
+                lb_addlstring(B, cap, len);
+                lua_pop(L, 2);
+            }
+        }
+    }
+}
+
+static void add_value(MatchState *ms, lb_Buffer *B, const char *s,
+                      const char *e, int tr) {
+    lua_State *L = ms->L;
+    ptrdiff_t so = s - ms->src_init, eo = e - ms->src_init;
+    size_t len;
+    const char *res;
+    switch (tr) {
+    case LUA_TFUNCTION: {
+        int n;
+        lua_pushvalue(L, 3);
+        n = push_captures(ms, s, e);
+        lua_call(L, n, 1);
+        break;
+    }
+    case LUA_TTABLE:
+        push_onecapture(ms, 0, s, e);
+        lua_gettable(L, 3);
+        break;
+    default: /* LUA_TNUMBER or LUA_TSTRING */
+        add_s(ms, B, s, e);
+        return;
+    }
+    sync_source(ms, eo);
+    s = ms->src_init + so, e = ms->src_init + eo;
+    if (!lua_toboolean(L, -1)) { /* nil or false? */
+        lua_pop(L, 1);
+        lua_pushlstring(L, s, e - s); /* keep original text */
+    }
+    else if (!lb_isbufferorstring(L, -1))
+        luaL_error(L, "invalid replacement value (a %s)", luaL_typename(L, -1));
+    res = lb_tolstring(L, -1, &len);
+    lb_addlstring(B, res, len);
+    lua_pop(L, 1);
+}
+
+static int Lgsub(lua_State *L) {
+    /* b:gsub(pattern, repl[, n[, dst]]) */
+    size_t srcl, lp;
+    const char *src = lb_checklstring(L, 1, &srcl);
+    const char *p = check_pattern(L, 2, &lp);
+    lua_Integer max_s = luaL_optinteger(L, 4, srcl + 1);
+    lb_Buffer *S = lb_testbuffer(L, 1), *D = lb_testbuffer(L, 5);
+    int tr, own = D == NULL || D == S;
+    int anchor = (*p == '^');
+    lua_Integer n = 0;
+#if LB_LASTMATCH
+    ptrdiff_t last = -1; /* end of last match */
+#endif
+    MatchState ms;
+    if (lb_testbuffer(L, 3) != NULL)
+        check_pattern(L, 3, NULL);
+    tr = lua_type(L, 3);
+    luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
+                     tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
+                     "string/function/table expected");
+    if (!lua_isnoneornil(L, 5) && D == NULL)
+        type_error(L, 5, "buffer");
+    if (D != NULL || S != NULL)
+        writable(L, D != NULL ? D : S);
+    lua_settop(L, 5);
+    if (own) { /* collect result in a new buffer */
+        D = lb_newbuffer(L);
+        lua_replace(L, 5);
+    }
+    if (anchor) {
+        p++; lp--; /* skip anchor character */
+    }
+    prepstate(&ms, L, src, srcl, p, lp);
+    ms.B = S;
+    while (n < max_s) {
+        const char *e;
+        reprepstate(&ms);
+#if LB_LASTMATCH
+        if ((e = match(&ms, src, p)) != NULL && e - ms.src_init != last) {
+            ptrdiff_t eo = e - ms.src_init;
+            n++;
+            add_value(&ms, D, src, e, tr);
+            src = ms.src_init + (last = eo); /* skip it */
+        }
+#else
+        if ((e = match(&ms, src, p)) != NULL) {
+            ptrdiff_t so = src - ms.src_init, eo = e - ms.src_init;
+            n++;
+            add_value(&ms, D, src, e, tr);
+            src = ms.src_init + so, e = ms.src_init + eo;
+        }
+        if (e != NULL && e > src) /* non empty match? */
+            src = e; /* skip it */
+#endif
+        else if (src < ms.src_end)
+            lb_addchar(D, *src++);
+        else break;
+        if (anchor) break;
+    }
+    lb_addlstring(D, src, ms.src_end - src);
+    if (!own) /* appended to dst */
+        lua_pushvalue(L, 5);
+    else if (S != NULL) { /* copy result back to source buffer */
+        /* grow first, a pinned or sub buffer raises before it's changed */
+        lb_prepbuffsize(S, D->n > S->n ? D->n - S->n : 0);
+        S->n = 0;
+        lb_addlstring(S, D->b, D->n);
+        lua_pushvalue(L, 1);
+    }
+    else
+        lua_pushlstring(L, D->b, D->n);
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+
+/* multiple patterns matcher (Aho-Corasick), the automaton is a DFA
+ * over classes of bytes appear in patterns */
+
+typedef struct lb_Matcher {
+    int npatterns, nstates, nclasses;
+    int nfirst;                 /* number of bytes can start a match */
+    unsigned short classes[256]; /* byte to class, 0 if not in patterns */
+    unsigned char first[256];   /* can the byte start a match? */
+    unsigned char firsts[4];    /* the first bytes, if nfirst <= 4 */
+    int *trans;     /* transitions, nstates * nclasses */
+    int *out;       /* id of pattern ends at the state, or -1 */
+    int *report;    /* first state with output in suffix chain, or -1 */
+    int *next;      /* next state with output after this, or -1 */
+    size_t *lens;   /* lengths of patterns */
+} lb_Matcher;
+
+#define LB_MATCHER LB_LIBNAME ".matcher"
+
+static void ac_build(lua_State *L, lb_Matcher *M, int total) {
+    int nc = M->nclasses, i, c, head = 0, tail = 0;
+    int *queue = (int*)lua_newuserdata(L, sizeof(int) * (total + 1) * 2);
+    int *fail = queue + total + 1;
+    /* build the trie */
+    M->nstates = 1;
+    for (i = 1; i <= M->npatterns; ++i) {
+        size_t k, len;
+        const char *s;
+        int st = 0;
+        lua_rawgeti(L, 1, i);
+        s = lb_tolstring(L, -1, &len);
+        for (k = 0; k < len; ++k) {
+            int *t = &M->trans[st * nc + M->classes[uchar(s[k])]];
+            if (*t == 0) *t = M->nstates++;
+            st = *t;
+        }
+        if (M->out[st] >= 0)
+            luaL_argerror(L, 1, lua_pushfstring(L,
+                    "duplicate patterns in [%d] and [%d]", M->out[st], i));
+        M->out[st] = i;
+        M->lens[i - 1] = len;
+        lua_pop(L, 1);
+    }
+    /* compute failure links in BFS order, and fill missing
+     * transitions with the ones of failure state */
+    M->report[0] = M->next[0] = -1;
+    for (c = 0; c < nc; ++c) {
+        int t = M->trans[c];
+        if (t != 0) fail[t] = 0, queue[tail++] = t;
+    }
+    while (head < tail) {
+        int u = queue[head++], f = fail[u];
+        M->next[u] = M->report[f];
+        M->report[u] = M->out[u] >= 0 ? u : M->next[u];
+        for (c = 0; c < nc; ++c) {
+            int *t = &M->trans[u * nc + c];
+            if (*t != 0) {
+                fail[*t] = M->trans[f * nc + c];
+                queue[tail++] = *t;
+            }
+            else
+                *t = M->trans[f * nc + c];
+        }
+    }
+    lua_pop(L, 1); /* pop queue */
+    /* bytes can start a match */
+    M->nfirst = 0;
+    for (c = 0; c < 256; ++c) {
+        M->first[c] = M->classes[c] != 0 && M->trans[M->classes[c]] != 0;
+        if (M->first[c] && M->nfirst++ < 4)
+            M->firsts[M->nfirst - 1] = (unsigned char)c;
+    }
+    for (i = M->nfirst; i < 4; ++i)
+        M->firsts[i] = M->firsts[0];
+}
+
+static int Lmatcher(lua_State *L) {
+    /* buffer.matcher{ pattern, ... } */
+    lb_Matcher *M;
+    unsigned short classes[256];
+    int i, n, nclasses = 1;
+    size_t total = 0, nstates, size;
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = (int)lua_rawlen(L, 1);
+    luaL_argcheck(L, n > 0, 1, "patterns expected");
+    memset(classes, 0, sizeof(classes));
+    for (i = 1; i <= n; ++i) {
+        size_t k, len;
+        const char *s;
+        lua_rawgeti(L, 1, i);
+        if (!lb_isbufferorstring(L, -1))
+            luaL_error(L, "buffer/string expected in [%d], got %s",
+                    i, luaL_typename(L, -1));
+        s = lb_tolstring(L, -1, &len);
+        if (len == 0)
+            luaL_error(L, "empty pattern in [%d]", i);
+        for (k = 0; k < len; ++k)
+            if (classes[uchar(s[k])] == 0)
+                classes[uchar(s[k])] = (unsigned short)nclasses++;
+        total += len;
+        lua_pop(L, 1);
+    }
+    /* the trie has at most total+1 states */
+    nstates = total + 1;
+    if (total >= 0x7FFFFFF || nstates > (~(size_t)0) / sizeof(int) /
+            (nclasses + 3))
+        luaL_error(L, "patterns too large");
+    size = sizeof(lb_Matcher) + n * sizeof(size_t)
+         + nstates * (nclasses + 3) * sizeof(int);
+    M = (lb_Matcher*)lua_newuserdata(L, size);
+    M->npatterns = n;
+    M->nclasses = nclasses;
+    memcpy(M->classes, classes, sizeof(classes));
+    M->lens = (size_t*)(M + 1);
+    M->trans = (int*)(M->lens + n);
+    M->out = M->trans + nstates * nclasses;
+    M->report = M->out + nstates;
+    M->next = M->report + nstates;
+    memset(M->trans, 0, nstates * nclasses * sizeof(int));
+    for (i = 0; i < (int)nstates; ++i)
+        M->out[i] = -1;
+    ac_build(L, M, (int)total);
+    luaL_getmetatable(L, LB_MATCHER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static const char *ac_skip(const lb_Matcher *M, const char *p,
+                           const char *end) {
+    /* skip bytes can not start a match */
+#ifdef LB_SSE2
+    if (M->nfirst <= 4) {
+        __m128i f0 = _mm_set1_epi8((char)M->firsts[0]);
+        __m128i f1 = _mm_set1_epi8((char)M->firsts[1]);
+        __m128i f2 = _mm_set1_epi8((char)M->firsts[2]);
+        __m128i f3 = _mm_set1_epi8((char)M->firsts[3]);
+        for (; end - p >= 16; p += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i m = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, f0), _mm_cmpeq_epi8(v, f1)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, f2), _mm_cmpeq_epi8(v, f3)));
+            unsigned mask = (unsigned)_mm_movemask_epi8(m);
+            if (mask != 0)
+                return p + lb_ctz(mask);
+        }
+    }
+#endif
+    while (p < end && !M->first[uchar(*p)])
+        ++p;
+    return p;
+}
+
+static int ac_step(const lb_Matcher *M, const char **pp, const char *end,
+                   int st) {
+    /* run until a state has output, or the end of data */
+    const char *p = *pp;
+    while (p < end) {
+        if (st == 0 && (p = ac_skip(M, p, end)) == end)
+            break;
+        st = M->trans[st * M->nclasses + M->classes[uchar(*p++)]];
+        if (M->report[st] >= 0)
+            break;
+    }
+    *pp = p;
+    return st;
+}
+
+static int Lmatcher_scan(lua_State *L) {
+    /* m:scan(b[, i[, j]]) */
+    lb_Matcher *M = (lb_Matcher*)luaL_checkudata(L, 1, LB_MATCHER);
+    size_t len;
+    const char *s = lb_checklstring(L, 2, &len);
+    const char *p = s + rangerelat(L, 3, &len), *end = p + len;
+    int st = 0, n = 0;
+    lua_newtable(L); /* start positions */
+    lua_newtable(L); /* pattern ids */
+    while (p < end) {
+        int r;
+        st = ac_step(M, &p, end, st);
+        for (r = M->report[st]; r >= 0; r = M->next[r]) {
+            int id = M->out[r];
+            lua_pushinteger(L, (p - s) - M->lens[id - 1] + 1);
+            lua_rawseti(L, -3, ++n);
+            lua_pushinteger(L, id);
+            lua_rawseti(L, -2, n);
+        }
+    }
+    return 2;
+}
+
+static int matcher_aux(lua_State *L) {
+    lb_Matcher *M = (lb_Matcher*)lua_touserdata(L, lua_upvalueindex(2));
+    size_t len, pos = (size_t)lua_tointeger(L, lua_upvalueindex(3));
+    size_t last = (size_t)lua_tointeger(L, lua_upvalueindex(4));
+    int st = (int)lua_tointeger(L, lua_upvalueindex(5));
+    int r = (int)lua_tointeger(L, lua_upvalueindex(6)), id;
+    const char *s = lb_tolstring(L, lua_upvalueindex(1), &len);
+    if (last > len) last = len; /* the buffer may be changed */
+    if (r < 0) {
+        const char *p = s + pos;
+        if (pos >= last) return 0;
+        st = ac_step(M, &p, s + last, st);
+        pos = p - s;
+        if ((r = M->report[st]) < 0) { /* no more matches */
+            lua_pushinteger(L, last);
+            lua_replace(L, lua_upvalueindex(3));
+            return 0;
+        }
+    }
+    id = M->out[r];
+    lua_pushinteger(L, pos);
+    lua_replace(L, lua_upvalueindex(3));
+    lua_pushinteger(L, st);
+    lua_replace(L, lua_upvalueindex(5));
+    lua_pushinteger(L, M->next[r]);
+    lua_replace(L, lua_upvalueindex(6));
+    lua_pushinteger(L, pos - M->lens[id - 1] + 1);
+    lua_pushinteger(L, pos);
+    lua_pushinteger(L, id);
+    return 3;
+}
+
+static int Lmatcher_gmatch(lua_State *L) {
+    /* for start, end, id in m:gmatch(b[, i[, j]]) do ... end */
+    size_t len;
+    size_t i;
+    luaL_checkudata(L, 1, LB_MATCHER);
+    lb_checklstring(L, 2, &len);
+    i = rangerelat(L, 3, &len);
+    lua_settop(L, 2);
+    lua_insert(L, 1); /* subject, matcher */
+    lua_pushinteger(L, i);
+    lua_pushinteger(L, i + len);
+    lua_pushinteger(L, 0);  /* state */
+    lua_pushinteger(L, -1); /* pending output */
+    lua_pushcclosure(L, matcher_aux, 6);
+    return 1;
+}
+
+
+/* checksums: CRC-32 (zlib), CRC-32C (Castagnoli) and Adler-32.
+ * CRCs are computed by slicing-by-8 tables, CRC-32C uses the crc32
+ * instruction of SSE4.2 and CRC-32 folds 64 bytes a time by PCLMUL if
+ * the compiler enables them (e.g. -msse4.2 -mpclmul) */
+
+#define CRC32_POLY  0xEDB88320u
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32_table[8][256];
+#ifndef LB_SSE42
+static uint32_t crc32c_table[8][256];
+#endif
+
+static void crc_inittable(uint32_t t[8][256], uint32_t poly) {
+    uint32_t i, k, c;
+    for (i = 0; i < 256; ++i) {
+        for (c = i, k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ poly : c >> 1;
+        t[0][i] = c;
+    }
+    for (i = 0; i < 256; ++i)
+        for (c = t[0][i], k = 1; k < 8; ++k)
+            t[k][i] = c = t[0][c & 0xFF] ^ (c >> 8);
+}
+
+static void crc_init(void) {
+    crc_inittable(crc32_table, CRC32_POLY);
+#ifndef LB_SSE42
+    crc_inittable(crc32c_table, CRC32C_POLY);
+#endif
+}
+
+#define load32le(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | \
+                     (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+static uint32_t crc_slice8(uint32_t t[8][256], uint32_t crc,
+                           const unsigned char *p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        uint32_t a = load32le(p) ^ crc, b = load32le(p + 4);
+        crc = t[7][a & 0xFF] ^ t[6][(a >> 8) & 0xFF]
+            ^ t[5][(a >> 16) & 0xFF] ^ t[4][a >> 24]
+            ^ t[3][b & 0xFF] ^ t[2][(b >> 8) & 0xFF]
+            ^ t[1][(b >> 16) & 0xFF] ^ t[0][b >> 24];
+    }
+    while (n--)
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef LB_PCLMUL
+static uint32_t crc32_fold(uint32_t crc, const unsigned char *p, size_t n) {
+    /* folds n (>= 64, multiple of 16) bytes by carry-less multiply,
+     * see Intel's "Fast CRC Computation Using PCLMULQDQ Instruction" */
+    static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+    static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+    static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+    static const uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    x0 = _mm_loadu_si128((const __m128i*)k1k2);
+    for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                _mm_loadu_si128((const __m128i*)(p + 0x30)));
+    }
+    /* fold 4 x 128 bits into 128 bits, then the rest 16 bytes blocks */
+    x0 = _mm_loadu_si128((const __m128i*)k3k4);
+#define FOLD(x, y) \
+    x5 = _mm_clmulepi64_si128(x, x0, 0x00); \
+    x = _mm_clmulepi64_si128(x, x0, 0x11); \
+    x = _mm_xor_si128(_mm_xor_si128(x, y), x5)
+    FOLD(x1, x2);
+    FOLD(x1, x3);
+    FOLD(x1, x4);
+    for (; n >= 16; p += 16, n -= 16) {
+        x2 = _mm_loadu_si128((const __m128i*)p);
+        FOLD(x1, x2);
+    }
+#undef FOLD
+    /* fold 128 bits to 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, x0, 0x00), x2);
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_loadu_si128((const __m128i*)poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char *p, size_t n) {
+#ifdef LB_PCLMUL
+    if (n >= 64) {
+        size_t m = n & ~(size_t)15;
+        crc = crc32_fold(crc, p, m);
+        p += m, n -= m;
+    }
+#endif
+    return crc_slice8(crc32_table, crc, p, n);
+}
+
+static uint32_t crc32c_update(uint32_t crc, const unsigned char *p, size_t n) {
+#ifdef LB_SSE42
+#  ifdef __x86_64__
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#  endif
+    while (n--)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+#else
+    return crc_slice8(crc32c_table, crc, p, n);
+#endif
+}
+
+#define ADLER_BASE 65521u
+#define ADLER_NMAX 5552 /* max n that 255n(n+1)/2 + (n+1)(BASE-1) fits 32 bits */
+
+static uint32_t adler32_update(uint32_t adler, const unsigned char *p, size_t n) {
+    uint32_t a = adler & 0xFFFF, b = adler >> 16;
+    while (n > 0) {
+        size_t k = n < ADLER_NMAX ? n : ADLER_NMAX;
+        n -= k;
+        for (; k >= 8; p += 8, k -= 8) {
+            a += p[0]; b += a; a += p[1]; b += a;
+            a += p[2]; b += a; a += p[3]; b += a;
+            a += p[4]; b += a; a += p[5]; b += a;
+            a += p[6]; b += a; a += p[7]; b += a;
+        }
+        while (k--) {
+            a += *p++;
+            b += a;
+        }
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+    return b << 16 | a;
+}
+
+static int checksum(lua_State *L, int kind) {
+    /* b:crc32([i[, j[, seed]]]), seed is the result of last chunk */
+    size_t len;
+    const char *s = lb_checklstring(L, 1, &len);
+    const unsigned char *p = (const unsigned char*)s + rangerelat(L, 2, &len);
+    uint32_t r = (uint32_t)luaL_optinteger(L, 4, kind == 'a' ? 1 : 0);
+    switch (kind) {
+    case 'c': r = ~crc32_update(~r, p, len); break;
+    case 'C': r = ~crc32c_update(~r, p, len); break;
+    default:  r = adler32_update(r, p, len); break;
+    }
+    lua_pushinteger(L, (lua_Integer)r);
+    return 1;
+}
+
+static int Lcrc32(lua_State *L)   { return checksum(L, 'c'); }
+static int Lcrc32c(lua_State *L)  { return checksum(L, 'C'); }
+static int Ladler32(lua_State *L) { return checksum(L, 'a'); }
+
+
+/* base64 */
+
+#define B64_PAD   64  /* '=' */
+#define B64_SPACE 65  /* white spaces are skipped */
+#define B64_BAD   255
+
+static const char b64_std[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char b64_url[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* decode table, accepts both standard and url-safe alphabets */
+static const unsigned char b64_dec[256] = {
+    255, 255, 255, 255, 255, 255, 255, 255, 255,  65,  65,  65,  65,  65, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+     65, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,  62, 255,  62, 255,  63,
+     52,  53,  54,  55,  56,  57,  58,  59,  60,  61, 255, 255, 255,  64, 255, 255,
+    255,   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,
+     15,  16,  17,  18,  19,  20,  21,  22,  23,  24,  25, 255, 255, 255, 255,  63,
+    255,  26,  27,  28,  29,  30,  31,  32,  33,  34,  35,  36,  37,  38,  39,  40,
+     41,  42,  43,  44,  45,  46,  47,  48,  49,  50,  51, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+    255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+};
+
+typedef struct b64_State {
+    int url;            /* url-safe alphabet and no padding */
+    int mode;           /* 'e' or 'd' while streaming, 0 if idle */
+    int done;           /* padding seen in decoding */
+    int npad;           /* padding chars still expected */
+    int npend;          /* number of pending bytes/chars */
+    unsigned char pend[4];
+} b64_State;
+
+#define LB_BASE64 LB_LIBNAME ".base64"
+
+static char *b64_quad(char *d, const char *tab,
+                      unsigned a, unsigned b, unsigned c) {
+    unsigned n = a << 16 | b << 8 | c;
+    d[0] = tab[n >> 18];
+    d[1] = tab[n >> 12 & 0x3F];
+    d[2] = tab[n >> 6 & 0x3F];
+    d[3] = tab[n & 0x3F];
+    return d + 4;
+}
+
+static void b64_encode(lb_Buffer *B, b64_State *S, const char *s, size_t len) {
+    const char *tab = S->url ? b64_url : b64_std;
+    const unsigned char *p = (const unsigned char*)s;
+    char *d, *start;
+    if ((S->npend + len) / 3 > (~(size_t)0) / 4)
+        luaL_error(B->L, "resulting buffer too large");
+    start = d = lb_prepbuffsize(B, (S->npend + len) / 3 * 4);
+    while (S->npend != 0 && len != 0) { /* complete pending bytes */
+        S->pend[S->npend++] = *p++, --len;
+        if (S->npend == 3) {
+            d = b64_quad(d, tab, S->pend[0], S->pend[1], S->pend[2]);
+            S->npend = 0;
+        }
+    }
+    for (; len >= 12; len -= 12, p += 12) { /* unrolled main loop */
+        d = b64_quad(d, tab, p[0], p[1], p[2]);
+        d = b64_quad(d, tab, p[3], p[4], p[5]);
+        d = b64_quad(d, tab, p[6], p[7], p[8]);
+        d = b64_quad(d, tab, p[9], p[10], p[11]);
+    }
+    for (; len >= 3; len -= 3, p += 3)
+        d = b64_quad(d, tab, p[0], p[1], p[2]);
+    while (len-- != 0)
+        S->pend[S->npend++] = *p++;
+    lb_addsize(B, d - start);
+}
+
+static void b64_encodefinish(lb_Buffer *B, b64_State *S) {
+    char quad[4];
+    if (S->npend == 0) return;
+    b64_quad(quad, S->url ? b64_url : b64_std, S->pend[0],
+            S->npend > 1 ? S->pend[1] : 0, 0);
+    if (S->url)
+        lb_addlstring(B, quad, S->npend + 1);
+    else {
+        if (S->npend == 1) quad[2] = '=';
+        quad[3] = '=';
+        lb_addlstring(B, quad, 4);
+    }
+    S->npend = 0;
+}
+
+static void b64_flush(lb_Buffer *B, b64_State *S) {
+    /* write bytes in pending chars, npend should be 2 or 3 */
+    unsigned n = S->pend[0] << 18 | S->pend[1] << 12;
+    if (S->npend == 3) n |= S->pend[2] << 6;
+    lb_addchar(B, (char)(n >> 16));
+    if (S->npend == 3) lb_addchar(B, (char)(n >> 8));
+    S->npend = 0;
+}
+
+static size_t b64_decode(lb_Buffer *B, b64_State *S, const char *s, size_t len) {
+    /* returns the offset of first invalid char, or len */
+    const unsigned char *p = (const unsigned char*)s;
+    size_t i = 0;
+    char *d, *start;
+    start = d = lb_prepbuffsize(B, len / 4 * 3 + 3);
+    while (i < len) {
+        unsigned v = b64_dec[p[i]];
+        if (!S->done && S->npend == 0) { /* fast path for whole quads */
+            while (i + 4 <= len) {
+                unsigned a = b64_dec[p[i]], b = b64_dec[p[i+1]];
+                unsigned c = b64_dec[p[i+2]], e = b64_dec[p[i+3]];
+                if ((a | b | c | e) >= 64) break;
+                e |= a << 18 | b << 12 | c << 6;
+                d[0] = (char)(e >> 16);
+                d[1] = (char)(e >> 8);
+                d[2] = (char)e;
+                d += 3, i += 4;
+            }
+            if (i == len) break;
+            v = b64_dec[p[i]];
+        }
+        if (v == B64_SPACE)
+            ;
+        else if (v == B64_PAD) {
+            if (!S->done) {
+                if (S->npend < 2) break;
+                S->npad = 3 - S->npend;
+                lb_addsize(B, d - start);
+                b64_flush(B, S);
+                start = d = lb_prepbuffsize(B, (len - i) / 4 * 3 + 3);
+                S->done = 1;
+            }
+            else if (S->npad == 0) /* too many padding chars */
+                break;
+            else
+                --S->npad;
+        }
+        else if (v >= 64 || S->done)
+            break;
+        else {
+            S->pend[S->npend++] = (unsigned char)v;
+            if (S->npend == 4) {
+                unsigned n = S->pend[0] << 18 | S->pend[1] << 12
+                           | S->pend[2] << 6 | S->pend[3];
+                d[0] = (char)(n >> 16);
+                d[1] = (char)(n >> 8);
+                d[2] = (char)n;
+                d += 3;
+                S->npend = 0;
+            }
+        }
+        ++i;
+    }
+    lb_addsize(B, d - start);
+    return i;
+}
+
+static int b64_decodefinish(lb_Buffer *B, b64_State *S) {
+    /* returns 0 if data is truncated */
+    int ok = S->npend != 1 && S->npad == 0;
+    if (S->npend > 1) b64_flush(B, S);
+    S->npend = S->done = S->npad = 0;
+    return ok;
+}
+
+static int Ltobase64(lua_State *L) {
+    /* b:tobase64([i[, j]][, url]) */
+    size_t len;
+    const char *s = lb_checklstring(L, 1, &len);
+    int urlarg = lua_type(L, 2) != LUA_TNUMBER ? 2 :
+                 lua_type(L, 3) != LUA_TNUMBER ? 3 : 4;
+    b64_State S = { 0 };
+    lb_Buffer *B;
+    size_t i;
+    S.url = lua_toboolean(L, urlarg);
+    lua_settop(L, urlarg - 1);
+    i = rangerelat(L, 2, &len);
+    B = lb_newbuffer(L);
+    b64_encode(B, &S, &s[i], len);
+    b64_encodefinish(B, &S);
+    return 1;
+}
+
+static int Lfrombase64(lua_State *L) {
+    /* b:frombase64([i[, j]]) */
+    size_t len, err;
+    const char *s = lb_checklstring(L, 1, &len);
+    size_t i = rangerelat(L, 2, &len);
+    b64_State S = { 0 };
+    lb_Buffer *B = lb_newbuffer(L);
+    if ((err = b64_decode(B, &S, &s[i], len)) != len
+            || !b64_decodefinish(B, &S)) {
+        lua_pushnil(L);
+        lua_pushinteger(L, i + err + 1);
+        return 2;
+    }
+    return 1;
+}
+
+static b64_State *check_b64stream(lua_State *L, int mode) {
+    b64_State *S = (b64_State*)luaL_checkudata(L, 1, LB_BASE64);
+    if (mode != 0 && S->mode != 0 && S->mode != mode)
+        luaL_error(L, "base64 stream is %s", S->mode == 'e' ?
+                "encoding" : "decoding");
+    if (mode != 0) S->mode = mode;
+    return S;
+}
+
+static int Lbase64(lua_State *L) {
+    /* buffer.base64([url]) */
+    int url = lua_toboolean(L, 1);
+    b64_State *S = (b64_State*)lua_newuserdata(L, sizeof(b64_State));
+    memset(S, 0, sizeof(b64_State));
+    S->url = url;
+    luaL_getmetatable(L, LB_BASE64);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int Lb64_encode(lua_State *L) {
+    /* stream:encode(out, s[, i[, j]]) */
+    b64_State *S = check_b64stream(L, 'e');
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 2));
+    size_t len;
+    const char *s = lb_checklstring(L, 3, &len);
+    size_t i = rangerelat(L, 4, &len);
+    if (lb_testbuffer(L, 3) == B) { /* encoding into itself */
+        lua_pushlstring(L, &s[i], len);
+        s = lua_tostring(L, -1), i = 0;
+    }
+    b64_encode(B, S, &s[i], len);
+    lua_settop(L, 2);
+    return 1;
+}
+
+static int Lb64_decode(lua_State *L) {
+    /* stream:decode(out, s[, i[, j]]) */
+    b64_State *S = check_b64stream(L, 'd');
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 2));
+    size_t len, err;
+    const char *s = lb_checklstring(L, 3, &len);
+    size_t i = rangerelat(L, 4, &len);
+    if (lb_testbuffer(L, 3) == B) { /* decoding into itself */
+        lua_pushlstring(L, &s[i], len);
+        s = lua_tostring(L, -1), i = 0;
+    }
+    if ((err = b64_decode(B, S, &s[i], len)) != len) {
+        lua_pushnil(L);
+        lua_pushinteger(L, i + err + 1);
+        return 2;
+    }
+    lua_settop(L, 2);
+    return 1;
+}
+
+static int Lb64_finish(lua_State *L) {
+    /* stream:finish(out) */
+    b64_State *S = check_b64stream(L, 0);
+    lb_Buffer *B = writable(L, lb_checkbuffer(L, 2));
+    int mode = S->mode;
+    S->mode = 0;
+    if (mode == 'e')
+        b64_encodefinish(B, S);
+    else if (mode == 'd' && !b64_decodefinish(B, S)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "truncated base64 data");
+        return 2;
+    }
+    lua_settop(L, 2);
     return 1;
 }
 
@@ -577,6 +2847,7 @@ static int Lsetuint(lua_State *L) {
 typedef struct parse_info {
     lb_Buffer *B;       /* working lb_Buffer */
     size_t pos;         /* current working position in buffer */
+    size_t bitpos;      /* bits used of byte at pos by bit fields */
     int is_bigendian;
     int is_pack;
     int is_stringkey;
@@ -584,9 +2855,31 @@ typedef struct parse_info {
     int narg, nret;     /* numbers of arguments/return values */
     int level, index;   /* the level/index of nest table */
     int fmtpos;         /* the pos of fmt */
+    int top;            /* the pos of last argument */
+    int keys;           /* the pos of key table of compiled format */
     const char *fmt;    /* the format string pointer */
 } parse_info;
 
+#define PIF_INCOMPLETE 0x01 /* data ended before format finished */
+#define PIF_STREAM     0x02 /* more data may come, never truncate */
+
+typedef struct fmt_op {
+    int fmt;            /* format or delimiter */
+    int count;          /* repeat count, -1 for '$' */
+    size_t wide;        /* wide of format, 0 for default */
+    const char *key;    /* string key in format string, or NULL */
+    size_t keylen;
+    int keyref;         /* index of string key in key table, or 0 */
+} fmt_op;
+
+typedef struct lb_Format {
+    int insert_pos;     /* format starts with '!' */
+    int nops;
+    fmt_op ops[1];
+} lb_Format;
+
+#define LB_FORMAT LB_LIBNAME ".format"
+
 #define I(field) (info->field)
 
 static int source(parse_info *info) {
@@ -673,20 +2966,101 @@ static const char *lb_pushlstring(lua_State *L, const char *str, size_t len) {
     return lb_pushbuffer(L, str, len)->b;
 }
 
-#if LUA_VERSION_NUM < 502
-static const char *my_lua_pushlstring(lua_State *L, const char *str, size_t len) {
-    lua_pushlstring(L, str, len);
-    return str;
+static void check_fmtargs(parse_info *info, int fmt, size_t wide, int count) {
+    switch (fmt) {
+    case 's': case 'S': case 'z': case 'Z':
+    case 'b': case 'B': case 'c': case 'C':
+        break;
+    case 'd': case 'D': case 'p': case 'P':
+    case 'i': case 'I': case 'u': case 'U':
+        if (wide > 8) fmterror(
+                info,
+                "invalid wide of format '%c': only 1 to 8 supported.", fmt);
+        break;
+    case 'f': case 'F':
+        if (wide != 0 && wide != 4 && wide != 8) fmterror(
+                info,
+                "invalid wide of format '%c': only 4 or 8 supported.", fmt);
+        break;
+    case 'n': case 'N': case 'm': case 'M':
+        if (wide > 64) fmterror(
+                info,
+                "invalid wide of format '%c': only 1 to 64 bits supported.", fmt);
+        break;
+    case 'v': case 'V': case 'w': case 'W':
+    case 'l': case 'L': case 'a': case 'A':
+        if (wide != 0) fmterror(
+                info, "invalid wide of format '%c': varint has no wide", fmt);
+        break;
+    case '@': case '+': case '-':
+        if (count < 0)
+            fmterror(info, "invalid count of format '%c'", fmt);
+        break;
+    default:
+        fmterror(info, "invalid format '%c'", fmt);
+        break;
+    }
+}
+
+/* bit fields: bits are taken from the lowest bit of a byte first in
+ * little endian, and from the highest bit first in big endian */
+
+static uint64_t read_bits(const char *s, size_t bit, size_t n, int bigendian) {
+    uint64_t v = 0;
+    size_t got = 0;
+    for (; n > 0; ++s, bit = 0) {
+        size_t take = 8 - bit < n ? 8 - bit : n;
+        unsigned bits = uchar(*s);
+        bits = bigendian ? bits >> (8 - bit - take) : bits >> bit;
+        bits &= (1u << take) - 1;
+        if (bigendian)
+            v = v << take | bits;
+        else
+            v |= (uint64_t)bits << got;
+        got += take, n -= take;
+    }
+    return v;
+}
+
+static void write_bits(char *s, size_t bit, size_t n, uint64_t v, int bigendian) {
+    for (; n > 0; ++s, bit = 0) {
+        size_t take = 8 - bit < n ? 8 - bit : n;
+        size_t shift = bigendian ? 8 - bit - take : bit;
+        unsigned mask = ((1u << take) - 1) << shift, bits;
+        if (bigendian)
+            bits = (unsigned)(v >> (n - take));
+        else
+            bits = (unsigned)v, v >>= take;
+        *s = (char)((uchar(*s) & ~mask) | ((bits << shift) & mask));
+        n -= take;
+    }
+}
+
+static void bit_align(parse_info *info) {
+    /* the partly used byte is skipped */
+    if (I(bitpos) != 0) {
+        ++I(pos);
+        I(bitpos) = 0;
+    }
+}
+
+static size_t varint_at(parse_info *info, size_t blen, int fmt,
+                        lua_Integer *pi) {
+    /* returns the length of varint at pos, or 0 if data ended */
+    size_t n;
+    if (I(pos) >= blen) return 0;
+    if ((n = lb_unpackvarint(&I(B)->b[I(pos)], blen - I(pos), fmt, pi)) == 0
+            && blen - I(pos) >= 10)
+        fmterror(info, "invalid varint at %d", (int)I(pos) + 1);
+    return n;
 }
-#else
-#  define my_lua_pushlstring lua_pushlstring
-#endif
 
 static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
     size_t pos;
-    int top = lua_gettop(I(B)->L);
+    int top = I(top);
+    int stream = (I(flags) & PIF_STREAM) != 0;
     typedef const char *(*pushlstring_t)(lua_State * L, const char * str, size_t len);
-    pushlstring_t pushlstring = isupper(fmt) ?  lb_pushlstring : my_lua_pushlstring;
+    pushlstring_t pushlstring = isupper(fmt) ?  lb_pushlstring : lb_pushintern;
 
 #define SINK() do { if (I(level) == 0 && count < 0) pack_checkstack(1); \
         sink(info); } while (0)
@@ -721,9 +3095,10 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
                     && I(pos) + len < blen
                     && I(B)->b[I(pos) + len] != '\0')
                 ++len;
-            if ((fmt == 'z' || fmt == 'Z')
+            /* in stream mode, also wait for the optional '\0' */
+            if ((fmt == 'z' || fmt == 'Z' || stream)
                     && (I(pos) + len) >= blen
-                    && (wide == 0 || len < wide))
+                    && (stream || wide == 0 || len < wide))
                 return 0;
             pushlstring(I(B)->L, &I(B)->b[I(pos)], len); SINK();
             I(pos) += len;
@@ -747,8 +3122,8 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
             lua_pop(I(B)->L, 1); /* pop source */
         }
         BEGIN_UNPACK() {
-            if ((fmt == 'b' || fmt == 'B')
-                    && (I(pos) + wide >= blen))
+            if ((fmt == 'b' || fmt == 'B' || stream)
+                    && (I(pos) + wide > blen))
                 return 0;
             if (I(pos) + wide > blen) wide = blen - I(pos);
             pushlstring(I(B)->L, &I(B)->b[I(pos)], wide); SINK();
@@ -759,9 +3134,6 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
     case 'd': case 'D': /* length preceded data */
     case 'p': case 'P': /* length preceded string */
         if (wide == 0) wide = 4;
-        if (wide > 8) fmterror(
-                info,
-                "invalid wide of format '%c': only 1 to 8 supported.", fmt);
         BEGIN_PACK() {
             size_t len;
             const char *str = source_lstring(info, &len);
@@ -780,7 +3152,8 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
                     I(is_bigendian), &len);
             if (len > (size_t)(~(size_t)0)/2)
                 fmterror(info, "string too big in format '%c'", fmt);
-            if ((fmt == 'd' || fmt == 'D') && I(pos) + wide + len > blen)
+            if ((fmt == 'd' || fmt == 'D' || stream)
+                    && I(pos) + wide + len > blen)
                 return 0;
             I(pos) += wide;
             if (I(pos) + len > blen)
@@ -793,9 +3166,6 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
     case 'i': case 'I': /* int */
     case 'u': case 'U': /* unsigned int */
         if (wide == 0) wide = 4;
-        if (wide > 8) fmterror(
-                info,
-                "invalid wide of format '%c': only 1 to 8 supported.", fmt);
         BEGIN_PACK() {
             lb_atpos(I(B), I(pos), lb_packint(I(B), wide, I(is_bigendian),
                         source_integer(info)));
@@ -816,11 +3186,82 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
         }
         END_PACK();
 
+    case 'a': case 'A': /* varint length preceded data */
+        BEGIN_PACK() {
+            size_t len;
+            const char *str = source_lstring(info, &len);
+            lb_atpos(I(B), I(pos), {
+                I(pos) += lb_packvarint(I(B), 'v', (lua_Integer)len);
+                lb_addlstring(I(B), str, len);
+            });
+            I(pos) += len;
+            lua_pop(I(B)->L, 1); /* pop source */
+        }
+        BEGIN_UNPACK() {
+            lua_Integer len;
+            size_t n = varint_at(info, blen, 'v', &len);
+            if (n == 0) return 0;
+            if ((size_t)len > blen - I(pos) - n) {
+                if ((size_t)len > (size_t)(~(size_t)0)/2)
+                    fmterror(info, "string too big in format '%c'", fmt);
+                return 0;
+            }
+            I(pos) += n;
+            pushlstring(I(B)->L, &I(B)->b[I(pos)], (size_t)len); SINK();
+            I(pos) += (size_t)len;
+        }
+        END_PACK();
+
+    case 'v': case 'V': /* unsigned varint */
+    case 'w': case 'W': /* zigzag varint */
+    case 'l': case 'L': /* signed LEB128 */
+        BEGIN_PACK() {
+            lua_Integer i = source_integer(info);
+            lb_atpos(I(B), I(pos),
+                    I(pos) += lb_packvarint(I(B), tolower(fmt), i));
+            lua_pop(I(B)->L, 1); /* pop source */
+        }
+        BEGIN_UNPACK() {
+            lua_Integer i;
+            size_t n = varint_at(info, blen, tolower(fmt), &i);
+            if (n == 0) return 0;
+            I(pos) += n;
+            lua_pushinteger(I(B)->L, i); SINK();
+        }
+        END_PACK();
+
+    case 'n': case 'N': /* unsigned bit field */
+    case 'm': case 'M': /* signed bit field */
+        if (wide == 0) wide = 1;
+        BEGIN_PACK() {
+            lua_Integer i = source_integer(info);
+            size_t end = I(pos) + (I(bitpos) + wide + 7) / 8;
+            if (end > I(B)->n)
+                lb_addpadding(I(B), 0, end - I(B)->n);
+            write_bits(&I(B)->b[I(pos)], I(bitpos), wide, (uint64_t)i,
+                    I(is_bigendian));
+            I(bitpos) += wide;
+            I(pos) += I(bitpos) >> 3;
+            I(bitpos) &= 7;
+            lua_pop(I(B)->L, 1); /* pop source */
+        }
+        BEGIN_UNPACK() {
+            uint64_t v;
+            if (I(pos) + (I(bitpos) + wide + 7) / 8 > blen) return 0;
+            v = read_bits(&I(B)->b[I(pos)], I(bitpos), wide,
+                    I(is_bigendian));
+            if ((fmt == 'm' || fmt == 'M') && wide < 64
+                    && (v >> (wide - 1) & 1) != 0)
+                v |= ~(uint64_t)0 << wide;
+            I(bitpos) += wide;
+            I(pos) += I(bitpos) >> 3;
+            I(bitpos) &= 7;
+            lua_pushinteger(I(B)->L, (lua_Integer)v); SINK();
+        }
+        END_PACK();
+
     case 'f': case 'F': /* float */
         if (wide == 0) wide = 4;
-        if (wide != 4 && wide != 8) fmterror(
-                info,
-                "invalid wide of format '%c': only 4 or 8 supported.", fmt);
         BEGIN_PACK() {
             lua_Number num = source_number(info);
             lb_atpos(I(B), I(pos),
@@ -849,15 +3290,12 @@ static int do_packfmt(parse_info *info, char fmt, size_t wide, int count) {
         else
             pos = 0;
 check_seek:
-        if (count < 0)
-            fmterror(info, "invalid count of format '%c'", fmt);
-        if (pos > I(B)->n) pos = I(B)->n;
+        if (pos > I(B)->n) {
+            if (stream) return 0;
+            pos = I(B)->n;
+        }
         I(pos) = pos;
         break;
-
-    default:
-        fmterror(info, "invalid format '%c'", fmt);
-        break;
     }
     return 1;
 #undef SINK
@@ -923,6 +3361,9 @@ static int do_delimiter(parse_info *info, char fmt) {
         sink(info);
         break;
 
+    case '|': /* align bit fields to byte */
+        break; /* aligned by do_op */
+
     case '<': /* little bigendian */
         I(is_bigendian) = 0; break;
     case '>': /* big bigendian */
@@ -944,8 +3385,8 @@ static int do_delimiter(parse_info *info, char fmt) {
 #define skip_white(s) do { while (*(s) == ' ' || *(s) == '\t' \
                 || *(s) == '\r'|| *(s) == '\n' || *(s) == ',') ++(s); } while(0)
 
-static int parse_optint(const char **str, unsigned int *pn) {
-    unsigned int n = 0;
+static int parse_optint(const char **str, size_t *pn) {
+    size_t n = 0;
     const char *oldstr = *str;
     while (isdigit(**str)) n = n * 10 + uchar(*(*str)++ - '0');
     if (*str != oldstr) *pn = n;
@@ -970,8 +3411,9 @@ static void parse_fmtargs(parse_info *info, size_t *wide, int *count) {
     skip_white(I(fmt));
 }
 
-static void parse_stringkey(parse_info *info) {
+static void parse_stringkey(parse_info *info, fmt_op *op) {
     skip_white(I(fmt));
+    op->key = NULL;
     if (isalpha(*I(fmt)) || *I(fmt) == '_') {
         const char *curpos = I(fmt)++, *end;
         while (isalnum(*I(fmt)) || *I(fmt) == '_')
@@ -987,56 +3429,143 @@ static void parse_stringkey(parse_info *info) {
                 fmterror(info, "key without format near "LUA_QS, curpos);
             if (I(level) == 0)
                 fmterror(info, "key at top level near "LUA_QS, curpos);
-            lua_pushlstring(I(B)->L, curpos, end - curpos);
-            I(is_stringkey) = 1;
-            return;
+            op->key = curpos;
+            op->keylen = end - curpos;
         }
     }
-    I(is_stringkey) = 0;
+}
+
+static int parse_op(parse_info *info, fmt_op *op) {
+    parse_stringkey(info, op);
+    op->keyref = 0;
+    op->wide = 0;
+    op->count = 1;
+    if ((op->fmt = *I(fmt)++) == '\0')
+        return 0;
+    if (strchr("{}#<>=|", op->fmt) == NULL) {
+        parse_fmtargs(info, &op->wide, &op->count);
+        check_fmtargs(info, op->fmt, op->wide, op->count);
+    }
+    return 1;
+}
+
+static int do_op(parse_info *info, const fmt_op *op) {
+    if (I(bitpos) != 0 && strchr("{}<>=nNmM", op->fmt) == NULL)
+        bit_align(info); /* formats of bytes start at next byte */
+    I(is_stringkey) = op->key != NULL || op->keyref != 0;
+    if (op->keyref != 0)
+        lua_rawgeti(I(B)->L, I(keys), op->keyref);
+    else if (op->key != NULL)
+        lua_pushlstring(I(B)->L, op->key, op->keylen);
+    return do_delimiter(info, op->fmt)
+        || do_packfmt(info, op->fmt, op->wide, op->count);
+}
+
+static void fmt_incomplete(parse_info *info) {
+    /* data is incomplete: drop unfinished blocks and return nil */
+    if (I(is_stringkey))
+        lua_pop(I(B)->L, 1);
+    lua_pop(I(B)->L, I(level) * 3); /* 3 values per level */
+    I(level) = 0;
+    I(flags) |= PIF_INCOMPLETE;
+    lua_pushnil(I(B)->L); ++I(nret);
+}
+
+static int fmt_result(parse_info *info, int insert_pos) {
+    bit_align(info);
+    if (insert_pos) {
+        lua_pushinteger(I(B)->L, I(pos) + 1);
+        lua_insert(I(B)->L, -(++I(nret)));
+    }
+    return I(nret);
 }
 
 static int parse_fmt(parse_info *info) {
-    int fmt, insert_pos = 0;
+    fmt_op op;
+    int insert_pos = 0;
     skip_white(I(fmt));
     if (*I(fmt) == '!') {
         insert_pos = 1; /* only enabled in unpack */
         ++I(fmt);
     }
-    while (parse_stringkey(info), (fmt = *I(fmt)++) != '\0') {
-        if (!do_delimiter(info, fmt)) {
-            size_t wide = 0;
-            int count = 1;
-            parse_fmtargs(info, &wide, &count);
-            if (!do_packfmt(info, fmt, wide, count)) {
-                if (I(is_stringkey))
-                    lua_pop(I(B)->L, 1);
-                lua_pop(I(B)->L, I(level) * 3); /* 3 values per level */
-                I(level) = 0;
-                lua_pushnil(I(B)->L); ++I(nret);
+    while (parse_op(info, &op)) {
+        if (!do_op(info, &op)) {
+            fmt_incomplete(info);
+            skip_white(I(fmt));
+            /* skip any block */
+            while (*I(fmt) == '{' || *I(fmt) == '}') {
+                ++I(fmt);
                 skip_white(I(fmt));
-                /* skip any block */
-                while (*I(fmt) == '{' || *I(fmt) == '}') {
-                    ++I(fmt);
-                    skip_white(I(fmt));
-                }
-                if ((fmt = *I(fmt)++) == '#')
-                    do_delimiter(info, fmt);
-                break;
             }
+            if (*I(fmt)++ == '#')
+                do_delimiter(info, '#');
+            break;
         }
     }
     if (I(level) != 0)
         fmterror(info, "unbalanced '{' in format");
-    if (insert_pos) {
-        lua_pushinteger(I(B)->L, I(pos) + 1);
-        lua_insert(I(B)->L, -(++I(nret)));
+    return fmt_result(info, insert_pos);
+}
+
+static int compile_fmt(parse_info *info, lb_Format *F) {
+    /* check format and count operations, store them in F if given */
+    fmt_op op;
+    int nops = 0;
+    skip_white(I(fmt));
+    if (F != NULL) F->insert_pos = *I(fmt) == '!';
+    if (*I(fmt) == '!') ++I(fmt);
+    while (parse_op(info, &op)) {
+        switch (op.fmt) {
+        case '{':
+            I(level) += 1; break;
+        case '}':
+            if (I(level)-- <= 0) fmterror(info,
+                    "unbalanced '}' in format near "LUA_QS, I(fmt) - 1);
+            break;
+        case '#':
+            if (I(level) != 0)
+                fmterror(info, "can only retrieve position out of block");
+            break;
+        }
+        if (F != NULL) {
+            if (op.key != NULL) { /* intern key in key table */
+                lua_pushlstring(I(B)->L, op.key, op.keylen);
+                op.keyref = (int)lua_rawlen(I(B)->L, I(keys)) + 1;
+                lua_rawseti(I(B)->L, I(keys), op.keyref);
+                op.key = NULL;
+            }
+            F->ops[nops] = op;
+        }
+        ++nops;
     }
-    return I(nret);
+    if (I(level) != 0)
+        fmterror(info, "unbalanced '{' in format");
+    return nops;
+}
+
+static int run_fmt(parse_info *info, const lb_Format *F) {
+    int i;
+    lua_getuservalue(I(B)->L, I(fmtpos));
+    I(keys) = lua_gettop(I(B)->L);
+    for (i = 0; i < F->nops; ++i) {
+        if (!do_op(info, &F->ops[i])) {
+            fmt_incomplete(info);
+            /* skip any block */
+            while (++i < F->nops && F->ops[i].keyref == 0
+                    && (F->ops[i].fmt == '{' || F->ops[i].fmt == '}'))
+                ;
+            if (i < F->nops && F->ops[i].fmt == '#')
+                do_delimiter(info, '#');
+            break;
+        }
+    }
+    return fmt_result(info, F->insert_pos);
 }
 
 static int do_pack(lb_Buffer *B, int narg, int pack) {
     lua_State *L = B->L;
     parse_info info = {NULL};
+    lb_Format *F;
     info.B = B;
     info.narg = narg;
     info.is_pack = pack;
@@ -1046,8 +3575,13 @@ static int do_pack(lb_Buffer *B, int narg, int pack) {
     if (lua_type(L, info.narg) == LUA_TNUMBER)
         info.pos = posrelat(lua_tointeger(L, info.narg++), info.B->n);
     info.fmtpos = info.narg++;
-    info.fmt = lb_checklstring(L, info.fmtpos, NULL);
-    parse_fmt(&info);
+    info.top = lua_gettop(L);
+    if ((F = (lb_Format*)testudata(L, info.fmtpos, LB_FORMAT)) != NULL)
+        run_fmt(&info, F);
+    else {
+        info.fmt = lb_checklstring(L, info.fmtpos, NULL);
+        parse_fmt(&info);
+    }
     if (pack) {
         lua_pushinteger(L, info.pos + 1);
         lua_insert(L, -(++info.nret));
@@ -1058,16 +3592,16 @@ static int do_pack(lb_Buffer *B, int narg, int pack) {
 static int Lpack(lua_State *L) {
     int res;
     lb_Buffer *B;
-    if ((B = lb_testbuffer(L, 1)) != NULL) {
-        res = do_pack(B, 2, 1);
-        lua_pushvalue(L, 1);
-    }
-    else {
-        lb_Buffer buff;
-        lb_buffinit(L, &buff);
-        res = do_pack(&buff, 1, 1);
-        lb_copybuffer(&buff);
+    if ((B = lb_testbuffer(L, 1)) == NULL) {
+        /* pack into a new buffer object directly, so its storage is
+         * released by __gc if packing raises a error */
+        B = lb_newbuffer(L);
+        lua_insert(L, 1);
     }
+    else
+        writable(L, B);
+    res = do_pack(B, 2, 1);
+    lua_pushvalue(L, 1);
     lua_insert(L, -res-1);
     return res+1;
 }
@@ -1084,6 +3618,374 @@ static int Lunpack(lua_State *L) {
     return do_pack(lb_checkbuffer(L, 1), 2, 0);
 }
 
+static lb_Format *new_format(lua_State *L, int idx) {
+    parse_info info = {NULL};
+    lb_Buffer B; /* only used to report errors */
+    lb_Format *F;
+    int nops;
+    lb_buffinit(L, &B);
+    info.B = &B;
+    info.fmtpos = idx;
+    info.fmt = lb_checklstring(L, idx, NULL);
+    nops = compile_fmt(&info, NULL);
+    F = (lb_Format*)lua_newuserdata(L,
+            sizeof(lb_Format) + nops * sizeof(fmt_op));
+    F->nops = nops;
+    lua_newtable(L);
+    info.keys = lua_gettop(L);
+    info.fmt = lb_checklstring(L, idx, NULL);
+    compile_fmt(&info, F);
+    lua_setuservalue(L, -2);
+    luaL_getmetatable(L, LB_FORMAT);
+    lua_setmetatable(L, -2);
+    return F;
+}
+
+static int Lcompile(lua_State *L) {
+    new_format(L, 1);
+    return 1;
+}
+
+static void store_record(lua_State *L, int res, lua_Integer i,
+                         int nret, int columns) {
+    /* store values of record i (on stack top) into result table */
+    int k, first = lua_gettop(L) - nret + 1;
+    if (!columns) {
+        if (nret != 1) {
+            lua_createtable(L, nret, 0);
+            for (k = 0; k < nret; ++k) {
+                lua_pushvalue(L, first + k);
+                lua_rawseti(L, -2, k + 1);
+            }
+        }
+        lua_rawseti(L, res, i);
+        return;
+    }
+    if (nret == 1 && lua_istable(L, first)) { /* one column per field */
+        lua_pushnil(L);
+        while (lua_next(L, first)) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, res);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                lua_newtable(L);
+                lua_pushvalue(L, -3);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, res);
+            }
+            lua_insert(L, -2);
+            lua_rawseti(L, -2, i);
+            lua_pop(L, 1);
+        }
+        return;
+    }
+    for (k = 0; k < nret; ++k) { /* one column per value */
+        lua_rawgeti(L, res, k + 1);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, res, k + 1);
+        }
+        lua_pushvalue(L, first + k);
+        lua_rawseti(L, -2, i);
+        lua_pop(L, 1);
+    }
+}
+
+static int Lunpackrecords(lua_State *L) {
+    /* b:unpackrecords([pos, ]fmt[, count[, columns]]) */
+    lb_Buffer fake, *B = &fake;
+    lb_Format *F;
+    int fmtpos = 2, columns, res;
+    lua_Integer i, count;
+    size_t pos = 0;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        lb_buffinit(L, &fake);
+        /* unpack never changes the content of buffer */
+        fake.b = (char*)lua_tolstring(L, 1, &fake.n);
+    }
+    else B = lb_checkbuffer(L, 1);
+    if (lua_type(L, fmtpos) == LUA_TNUMBER)
+        pos = posrelat(lua_tointeger(L, fmtpos++), B->n);
+    count = luaL_optinteger(L, fmtpos + 1, -1);
+    columns = lua_toboolean(L, fmtpos + 2);
+    if ((F = (lb_Format*)testudata(L, fmtpos, LB_FORMAT)) == NULL) {
+        F = new_format(L, fmtpos); /* parse the format only once */
+        lua_replace(L, fmtpos);
+    }
+    lua_settop(L, fmtpos);
+    /* every record takes at least one byte */
+    i = count < 0 || (size_t)count > B->n - pos ? B->n - pos : count;
+    lua_createtable(L, columns || i > 0xFFFF ? 0 : (int)i, 0);
+    res = lua_gettop(L);
+    for (i = 1; (count < 0 || i <= count) && pos < B->n; ++i) {
+        parse_info info = {NULL};
+        info.B = B;
+        info.pos = pos;
+        info.fmtpos = fmtpos;
+        info.narg = info.top = res;
+#if LB_BIGENDIAN
+        info.is_bigendian = 1;
+#endif
+        run_fmt(&info, F);
+        if ((info.flags & PIF_INCOMPLETE) != 0)
+            break;
+        store_record(L, res, i, info.nret, columns);
+        lua_settop(L, res);
+        if (info.pos <= pos) { /* no progress, stop here */
+            pos = info.pos; ++i;
+            break;
+        }
+        pos = info.pos;
+    }
+    lua_settop(L, res);
+    lua_pushinteger(L, i - 1);
+    lua_pushinteger(L, pos + 1);
+    return 3;
+}
+
+static int Lformat_unpack(lua_State *L) {
+    /* fmt:unpack(b[, pos]) equals b:unpack([pos, ]fmt) */
+    lua_pushvalue(L, 1);
+    lua_remove(L, 1);
+    return Lunpack(L);
+}
+
+/* streaming decoder: data is appended chunk by chunk, a unfinished
+ * record is suspended at the operation (and the repeat of it) where
+ * data ran out, its values and open blocks are saved in the uservalue
+ * of decoder, and decoding resumes there when more data arrived */
+
+typedef struct lb_Decoder {
+    int ip, rep;        /* next operation, and repeats done of it */
+    int level, index;   /* saved state of unfinished record */
+    int nret, is_bigendian;
+    int nsaved;         /* number of values saved in uservalue */
+    int busy;           /* set while decoding, so a error is noticed */
+    size_t pos, bitpos;
+} lb_Decoder;
+
+#define LB_DECODER LB_LIBNAME ".decoder"
+
+/* slots in uservalue of decoder */
+#define DEC_FORMAT   1
+#define DEC_BUFFER   2
+#define DEC_CALLBACK 3
+#define DEC_SAVED    4
+
+static void dec_reset(lb_Decoder *D) {
+    D->ip = D->rep = D->level = D->nret = D->nsaved = 0;
+    D->index = 1;
+#if LB_BIGENDIAN
+    D->is_bigendian = 1;
+#else
+    D->is_bigendian = 0;
+#endif
+    D->pos = D->bitpos = 0;
+}
+
+static lb_Buffer *dec_buffer(lua_State *L, lb_Decoder *D, int uv) {
+    /* pushes the buffer of decoder */
+    lb_Buffer *B;
+    lua_rawgeti(L, uv, DEC_BUFFER);
+    B = lb_testbuffer(L, -1);
+    if (D->busy) { /* last decoding raised a error, drop the data */
+        D->busy = 0;
+        dec_reset(D);
+        lb_consume(B, B->n);
+    }
+    return B;
+}
+
+static int dec_suspend(lua_State *L, lb_Decoder *D, parse_info *info,
+                       int uv, int base) {
+    int i, n;
+    if (info->is_stringkey) /* key of the unfinished operation */
+        lua_pop(L, 1);
+    if ((n = lua_gettop(L) - base) > 0) {
+        lua_createtable(L, n, 0);
+        lua_insert(L, base + 1);
+        for (i = n; i >= 1; --i)
+            lua_rawseti(L, base + 1, i);
+        lua_rawseti(L, uv, DEC_SAVED);
+    }
+    D->nsaved = n;
+    D->pos = info->pos;
+    D->bitpos = info->bitpos;
+    D->level = info->level;
+    D->index = info->index;
+    D->nret = info->nret;
+    D->is_bigendian = info->is_bigendian;
+    lua_settop(L, uv - 1);
+    return -1;
+}
+
+static int dec_record(lua_State *L, lb_Decoder *D) {
+    /* decodes the next record of decoder at index 1, pushes its values
+     * and returns the number of them, or returns -1 if the record is
+     * incomplete */
+    parse_info info = {NULL};
+    const lb_Format *F;
+    lb_Buffer *B;
+    int uv, base, i;
+    lua_getuservalue(L, 1);
+    uv = lua_gettop(L);
+    lua_rawgeti(L, uv, DEC_FORMAT);
+    F = (const lb_Format*)lua_touserdata(L, uv + 1);
+    B = dec_buffer(L, D, uv);
+    lua_getuservalue(L, uv + 1); /* keys of format */
+    base = lua_gettop(L);
+    if (D->nsaved > 0) { /* restore the suspended record */
+        luaL_checkstack(L, D->nsaved, "too many values in record");
+        lua_rawgeti(L, uv, DEC_SAVED);
+        for (i = 1; i <= D->nsaved; ++i)
+            lua_rawgeti(L, base + 1, i);
+        lua_remove(L, base + 1);
+        lua_pushnil(L);
+        lua_rawseti(L, uv, DEC_SAVED);
+    }
+    info.B = B;
+    info.pos = D->pos;
+    info.bitpos = D->bitpos;
+    info.flags = PIF_STREAM;
+    info.level = D->level;
+    info.index = D->index;
+    info.nret = D->nret;
+    info.is_bigendian = D->is_bigendian;
+    info.fmtpos = uv + 1;
+    info.keys = info.narg = info.top = base;
+    D->busy = 1;
+    while (D->ip < F->nops) {
+        const fmt_op *op = &F->ops[D->ip];
+        int done;
+        if (op->count > 1 && strchr("@+-", op->fmt) == NULL) {
+            fmt_op one = *op; /* one repeat a time */
+            one.count = 1;
+            if ((done = do_op(&info, &one)) && ++D->rep < op->count)
+                continue;
+        }
+        else
+            done = do_op(&info, op);
+        if (!done) break;
+        D->rep = 0;
+        ++D->ip;
+    }
+    D->busy = 0;
+    if (D->ip < F->nops)
+        return dec_suspend(L, D, &info, uv, base);
+    dec_reset(D);
+    bit_align(&info);
+    lb_consume(B, info.pos);
+    if (info.pos == 0)
+        luaL_error(L, "format consumes no data");
+    if (F->insert_pos) {
+        lua_pushinteger(L, info.pos + 1);
+        lua_insert(L, base + 1);
+        ++info.nret;
+    }
+    for (i = uv; i <= base; ++i) /* leave values only */
+        lua_remove(L, uv);
+    return info.nret;
+}
+
+static lb_Decoder *check_decoder(lua_State *L) {
+    return (lb_Decoder*)luaL_checkudata(L, 1, LB_DECODER);
+}
+
+static int Ldecoder(lua_State *L) {
+    /* buffer.decoder(fmt[, callback]) */
+    lb_Format *F;
+    lb_Decoder *D;
+    int i;
+    if (!lua_isnoneornil(L, 2))
+        luaL_checktype(L, 2, LUA_TFUNCTION);
+    lua_settop(L, 2);
+    if ((F = (lb_Format*)testudata(L, 1, LB_FORMAT)) == NULL) {
+        F = new_format(L, 1);
+        lua_replace(L, 1);
+    }
+    for (i = 0; i < F->nops; ++i)
+        if (F->ops[i].count < 0)
+            luaL_argerror(L, 1, "'$' can not be used in decoder");
+    D = (lb_Decoder*)lua_newuserdata(L, sizeof(lb_Decoder));
+    dec_reset(D);
+    D->busy = 0;
+    lua_createtable(L, 4, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, DEC_FORMAT);
+    lb_newbuffer(L);
+    lua_rawseti(L, -2, DEC_BUFFER);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, DEC_CALLBACK);
+    lua_setuservalue(L, -2);
+    luaL_getmetatable(L, LB_DECODER);
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static int Ldecoder_feed(lua_State *L) {
+    /* decoder:feed(s[, i[, j]]) */
+    lb_Decoder *D = check_decoder(L);
+    lb_Buffer *B;
+    size_t len;
+    const char *s = lb_checklstring(L, 2, &len);
+    int n, count = 0;
+    s += rangerelat(L, 3, &len);
+    lua_settop(L, 2);
+    lua_getuservalue(L, 1);
+    B = dec_buffer(L, D, 3);
+    lb_addlstring(B, unalias(B, s, len), len);
+    lua_settop(L, 3);
+    lua_rawgeti(L, 3, DEC_CALLBACK);
+    if (!lua_isnil(L, 4)) {
+        while ((n = dec_record(L, D)) >= 0) {
+            lua_pushvalue(L, 4);
+            lua_insert(L, -n - 1);
+            lua_call(L, n, 0);
+            ++count;
+        }
+    }
+    lua_pushinteger(L, count);
+    return 1;
+}
+
+static int Ldecoder_decode(lua_State *L) {
+    /* decoder:decode() */
+    int n = dec_record(L, check_decoder(L));
+    return n < 0 ? 0 : n;
+}
+
+static int decoder_aux(lua_State *L) {
+    lua_settop(L, 0);
+    lua_pushvalue(L, lua_upvalueindex(1));
+    return Ldecoder_decode(L);
+}
+
+static int Ldecoder_records(lua_State *L) {
+    check_decoder(L);
+    lua_settop(L, 1);
+    lua_pushcclosure(L, decoder_aux, 1);
+    return 1;
+}
+
+static int Ldecoder_buffer(lua_State *L) {
+    lb_Decoder *D = check_decoder(L);
+    lua_settop(L, 1);
+    lua_getuservalue(L, 1);
+    dec_buffer(L, D, 2);
+    return 1;
+}
+
+static int Ldecoder_reset(lua_State *L) {
+    lb_Decoder *D = check_decoder(L);
+    lua_settop(L, 1);
+    lua_getuservalue(L, 1);
+    D->busy = 1; /* drop all data */
+    dec_buffer(L, D, 2);
+    return_self(L);
+}
+
 #undef I
 
 
@@ -1091,8 +3993,14 @@ static int Lunpack(lua_State *L) {
 
 static int L__gc(lua_State *L) {
     lb_Buffer *B;
-    if ((B = lb_testbuffer(L, 1)) != NULL)
+    if ((B = lb_testbuffer(L, 1)) == NULL)
+        return 0;
+    if (B->flags & LB_VIEW)
+        lb_releasebuffer(L, 1);
+    else {
+        B->subs = 0; /* its sub buffers are unreachable as well */
         lb_resetbuffer(B);
+    }
     return 0;
 }
 
@@ -1133,7 +4041,7 @@ static int L__index(lua_State *L) {
 }
 
 static int L__newindex(lua_State *L) {
-    lb_Buffer *B = lb_checkbuffer(L, 1);
+    lb_Buffer *B = writable(L, check_gapbuffer(L, 1));
     int ch, pos = (int)luaL_checkinteger(L, 2);
     size_t len;
     const char *s;
@@ -1150,8 +4058,9 @@ static int L__newindex(lua_State *L) {
         ch = (int)lua_tointeger(L, 3);
 set_char:
         if (pos != B->n)
-            B->b[pos] = uchar(ch);
+            *gap_at(B, pos) = uchar(ch);
         else {
+            lb_closegap(B);
             lb_prepbuffsize(B, 1);
             B->b[pos] = uchar(ch);
             lb_addsize(B, 1);
@@ -1161,15 +4070,23 @@ set_char:
     case LUA_TSTRING:
     case LUA_TUSERDATA:
         s = lb_checklstring(L, 3, &len);
+        s = unalias(B, s, len);
         if (len == 1) {
             ch = s[0];
             goto set_char;
         }
         else if (pos == B->n) { /* append */
+            lb_closegap(B);
             lb_prepbuffsize(B, len);
             memcpy(&B->b[pos], s, len);
             lb_addsize(B, len);
         }
+        else if (gap_edit(B)) { /* replace in gap */
+            lb_opengap(B, pos, len);
+            memcpy(&B->b[pos], s, len);
+            B->gap += len;
+            lb_addsize(B, len - 1);
+        }
         else { /* replace */
             lb_prepbuffsize(B, len - 1);
             memmove(&B->b[pos + len], &B->b[pos + 1], B->n - pos - 1);
@@ -1180,6 +4097,7 @@ set_char:
 
     case LUA_TNIL:
     case LUA_TNONE:
+        lb_closegap(B);
         if (pos == B->n-1) B->n -= 1;
 
     default:
@@ -1208,7 +4126,7 @@ static int redir_to_strlib(lua_State *L, const char *name) {
     for (i = base; i <= top; ++i) {
         lb_Buffer *b = lb_testbuffer(L, i);
         if (b != NULL) {
-            lua_pushlstring(L, B->b, B->n);
+            lua_pushlstring(L, b->b, b->n);
             lua_replace(L, i);
         }
     }
@@ -1232,7 +4150,7 @@ static int redir_to_strlib(lua_State *L, const char *name) {
 }
 
 #define redir_functions(X) \
-    X(dump)   X(find)   X(format) X(gmatch) X(gsub)   X(match)
+    X(dump)   X(format)
 
 #define X(name) \
     static int lbR_##name (lua_State *L) \
@@ -1267,41 +4185,149 @@ int luaopen_buffer(lua_State *L) {
 
         /* request */
         ENTRY(byte),
+        ENTRY(capacity),
         ENTRY(cmp),
         ENTRY(eq),
+        ENTRY(find),
+        ENTRY(gmatch),
+        ENTRY(hash),
+        ENTRY(match),
+        ENTRY(matcher),
+        ENTRY(mmap),
+        ENTRY(writefd),
+        ENTRY(writeto),
+        ENTRY(writev),
+        ENTRY(icmp),
+        ENTRY(ieq),
         ENTRY(ipairs),
         ENTRY(isbuffer),
+        ENTRY(fileno),
+        ENTRY(load),
         ENTRY(len),
+        ENTRY(offset),
         ENTRY(quote),
+        ENTRY(sub),
+        ENTRY(subcount),
         ENTRY(topointer),
 
         /* modify */
         ENTRY(char),
         ENTRY(clear),
         ENTRY(copy),
+        ENTRY(growth),
+        ENTRY(gsub),
         ENTRY(insert),
+        ENTRY(intern),
         ENTRY(lower),
+        ENTRY(mode),
         ENTRY(move),
+        ENTRY(pool),
+        ENTRY(readfd),
+        ENTRY(readfrom),
+        ENTRY(release),
         ENTRY(remove),
         ENTRY(rep),
+        ENTRY(reserve),
         ENTRY(reverse),
         ENTRY(set),
         ENTRY(setlen),
+        ENTRY(shrink),
         ENTRY(swap),
         ENTRY(upper),
 
         /* binary support */
         ENTRY(tohex),
+        ENTRY(fromhex),
+        ENTRY(adler32),
+        ENTRY(base64),
+        ENTRY(crc32),
+        ENTRY(crc32c),
+        ENTRY(tobase64),
+        ENTRY(frombase64),
+        ENTRY(compile),
+        ENTRY(decoder),
+        ENTRY(getarray),
         ENTRY(getint),
         ENTRY(getuint),
         ENTRY(pack),
+        ENTRY(setarray),
         { "setint", Lsetuint },
         ENTRY(setuint),
         ENTRY(unpack),
+        ENTRY(unpackrecords),
 #undef ENTRY
         { NULL, NULL }
     };
 
+    luaL_Reg format_libs[] = {
+        { "pack",   Lpack          },
+        { "unpack", Lformat_unpack },
+        { NULL, NULL }
+    };
+
+    luaL_Reg decoder_libs[] = {
+        { "feed",    Ldecoder_feed    },
+        { "decode",  Ldecoder_decode  },
+        { "records", Ldecoder_records },
+        { "buffer",  Ldecoder_buffer  },
+        { "reset",   Ldecoder_reset   },
+        { NULL, NULL }
+    };
+
+    luaL_Reg base64_libs[] = {
+        { "encode", Lb64_encode },
+        { "decode", Lb64_decode },
+        { "finish", Lb64_finish },
+        { NULL, NULL }
+    };
+
+    luaL_Reg matcher_libs[] = {
+        { "scan",   Lmatcher_scan   },
+        { "gmatch", Lmatcher_gmatch },
+        { NULL, NULL }
+    };
+
+    crc_init();
+
+    /* create metatable of matcher */
+    if (luaL_newmetatable(L, LB_MATCHER)) {
+        luaL_setfuncs(L, matcher_libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    /* create metatable of file handle used by load() */
+    if (luaL_newmetatable(L, LB_FILE)) {
+        lua_pushcfunction(L, Lfile_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_pop(L, 1);
+
+    /* create metatable of base64 stream */
+    if (luaL_newmetatable(L, LB_BASE64)) {
+        luaL_setfuncs(L, base64_libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    /* create metatable of streaming decoder */
+    if (luaL_newmetatable(L, LB_DECODER)) {
+        luaL_setfuncs(L, decoder_libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
+    /* create metatable of compiled format */
+    if (luaL_newmetatable(L, LB_FORMAT)) {
+        luaL_setfuncs(L, format_libs, 0);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "__index");
+    }
+    lua_pop(L, 1);
+
     /* create metatable */
     if (luaL_newmetatable(L, LB_LIBNAME)) {
         luaL_setfuncs(L, libs, 0); /* 3->2 */
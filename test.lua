@@ -33,6 +33,9 @@ function test()
     test_reverse()
     test_alloc()
     test_modify()
+    test_grow()
+    test_capacity()
+    test_pool()
     test_byte()
     test_char()
     test_clear()
@@ -41,8 +44,29 @@ function test()
     test_remove()
     test_swap()
     test_cmp()
+    test_case()
+    test_find()
+    test_pattern()
     test_mt()
     test_pack()
+    test_compile()
+    test_records()
+    test_varint()
+    test_bits()
+    test_array()
+    test_hex()
+    test_base64()
+    test_checksum()
+    test_intern()
+    test_matcher()
+    test_sub()
+    test_gap()
+    test_consume()
+    test_file()
+    test_mmap()
+    test_write()
+    test_fd()
+    test_decoder()
     if not failed then
         test_msg "** ALL TEST PASSED!!"
     else
@@ -171,6 +195,89 @@ function test_modify()
     ok(b :eq "apple-pie", "assign operations ("..b..")")
 end
 
+function test_grow()
+    test_msg "test grow operations"
+    local b = buffer "apple"
+    for i = 1, 16 do b:insert(b) end
+    ok(#b == 5*2^16 and b:eq(("apple"):rep(2^16)), "append self ("..#b..")")
+    local b = buffer "apple-pie"
+    b:insert(6, b)
+    ok(b :eq "appleapple-pie-pie", "insert self ("..b..")")
+    local b = buffer "abc" :rep(5000)
+    ok(b :eq (("abc"):rep(5000)), "rep self ("..#b..")")
+    local b = buffer "apple"
+    b[6] = b
+    ok(b :eq "appleapple", "newindex self ("..b..")")
+    local b = buffer "apple"
+    b:pack(#b+1, "s", b)
+    ok(b :eq "appleapple\0", "pack self ("..b:quote()..")")
+    collectgarbage()
+    collectgarbage "stop"
+    local t, before = {}, collectgarbage "count"
+    for i = 1, 1000 do t[i] = buffer "apple-pie" end
+    local used = (collectgarbage "count" - before) * 1024 / 1000
+    collectgarbage "restart"
+    ok(used < 256, "small buffer is compact ("..used.." bytes per buffer)")
+    for i = 1, 100 do t[i] = buffer(10000, "x") end
+    t = nil
+    collectgarbage()
+    ok(buffer(20000):len() == 20000, "grow after collect")
+    local s = ("\1"):rep(5000)
+    local q, n = buffer.quote(s), select("#", buffer.quote(s), buffer.tohex(s))
+    ok(q == '"'..("\\001"):rep(5000)..'"' and n == 2, "string builder grows on stack")
+    local b = buffer(("x"):rep(100000))
+    for i = 1, 50 do setmetatable({}, { __gc = function() error "boom" end }) end
+    local r = pcall(b.insert, b, ("y"):rep(300000))
+    while not pcall(collectgarbage) do end
+    if r then b:setlen(100000) end
+    b:insert "z"
+    ok(#b == 100001 and b:byte(-1) == ("z"):byte(), "grow with erroring finalizers")
+    b = nil
+    collectgarbage()
+end
+
+function test_capacity()
+    test_msg "test capacity operations"
+    local b = buffer "apple"
+    ok(b:capacity() >= #b, "capacity of small buffer ("..b:capacity()..")")
+    b:reserve(1000)
+    ok(b:capacity() >= 1000 and b:eq "apple", "reserve capacity ("..b:capacity()..")")
+    b:shrink()
+    ok(b:capacity() < 1000 and b:eq "apple", "shrink to inline area ("..b:capacity()..")")
+    local b = buffer(5000, "x")
+    b:setlen(3000):shrink()
+    ok(b:capacity() == 3000 and b:eq(("x"):rep(3000)), "shrink to fit ("..b:capacity()..")")
+    ok(b:growth() == "double", "default growth policy ("..b:growth()..")")
+    b:growth "half" :insert "x"
+    ok(b:capacity() == 4500 and b:growth() == "half", "grow by half ("..b:capacity()..")")
+    b:growth "fixed" :shrink() :insert "x"
+    ok(b:capacity() == 6002, "fixed growth of small buffer ("..b:capacity()..")")
+end
+
+function test_pool()
+    test_msg "test storage pool"
+    local info = buffer.pool(1024*1024)
+    ok(info.limit == 1024*1024 and info.bytes == 0, "enable pool ("..info.limit..")")
+    local t = {}
+    for i = 1, 10 do t[i] = buffer(1000, "x") end
+    t = nil
+    collectgarbage()
+    info = buffer.pool()
+    ok(info.blocks == 10 and info.bytes == 10*1024, "collected storage cached ("..info.bytes..")")
+    local misses = info.misses
+    for i = 1, 10 do
+        local b = buffer(1000, "y")
+        ok(b :eq(("y"):rep(1000)), "buffer from pool ("..#b..")")
+    end
+    info = buffer.pool()
+    ok(info.hits >= 10 and info.misses == misses, "pool hits ("..info.hits..")")
+    local b = buffer(100):setlen(0)
+    b:insert(("z"):rep(5000)):shrink()
+    ok(b :eq(("z"):rep(5000)), "grow and shrink pooled buffer ("..#b..")")
+    info = buffer.pool(false)
+    ok(info.limit == 0 and info.bytes == 0, "disable pool ("..info.blocks..")")
+end
+
 function test_byte()
     test_msg "test byte operations"
     local b = buffer "apple-pie"
@@ -264,6 +371,141 @@ function test_cmp()
     ok(buffer("a"):cmp(buffer("b")) == -1,  "a:cmp(b) -> -1")
 end
 
+function test_case()
+    test_msg "test case mapping"
+    local s = ""
+    for i = 0, 255 do s = s..string.char(i) end
+    s = s..s:reverse()
+    ok(buffer(s):lower():eq(s:lower()), "lower all bytes")
+    ok(buffer(s):upper():eq(s:upper()), "upper all bytes")
+    local same = true
+    for i = 1, 25 do
+        local str = ("aBcDeFgHiJ"):rep(5)
+        same = same and buffer(str):upper(i, -i):eq(
+            str:sub(1, i-1)..str:sub(i, -i):upper()..str:sub(#str-i+2))
+    end
+    ok(same, "upper with range")
+    ok(buffer():lower():eq "", "lower empty buffer")
+    ok(buffer "ABC":lower(2, 10):eq "Abc", "lower out of range")
+    ok(buffer.icmp("Hello World", "hello world") == 0, "icmp equal")
+    ok(buffer.icmp("apple", "APPLF") == -1, "icmp less")
+    ok(buffer.icmp(("x"):rep(40).."b", ("X"):rep(40).."A") == 1, "icmp greater")
+    ok(buffer.icmp("abc", "ABCD") == -1 and buffer.icmp("abcd", "ABC") == 1, "icmp length")
+    ok(buffer.icmp("[", "{") == -1, "icmp folds to lower case")
+    ok(buffer(s:upper()):ieq(s:lower()), "ieq all bytes")
+    ok(not buffer.ieq("abc", "abd") and not buffer.ieq("abc", "ab"), "ieq different")
+    ok(not buffer.ieq(("a"):rep(32).."\200", ("A"):rep(32).."\201"), "ieq non ascii bytes")
+end
+
+function test_find()
+    test_msg "test find"
+    local function check(s, p, init)
+        local a1, b1 = buffer.find(s, p, init, true)
+        local a2, b2 = string.find(s, p, init, true)
+        return a1 == a2 and b1 == b2
+    end
+    local s = ("abcdefghij"):rep(30).."needle"..("x"):rep(100).."needle\0zz"
+    local same = true
+    for _, p in ipairs { "", "a", "j", "ab", "ja", "abc", "needle", "needle\0",
+            "needle\0zz", "zz", "x", "xn", ("x"):rep(50), "none", "\0", "jab" } do
+        for _, init in ipairs { 1, 2, 10, 11, 290, 300, 301, 307, 400, 411, 412,
+                -1, -6, -20, -1000 } do
+            same = same and check(s, p, init)
+        end
+    end
+    ok(same, "find plain strings")
+    local long = ("0123456789"):rep(4)
+    local hay = ("0123456789"):rep(300).."x"..long.."y"..long
+    same = true
+    for _, p in ipairs { long, "x"..long, long.."y", "9x0123", long.."z" } do
+        same = same and check(hay, p) and check(hay, p, 3001) and check(hay, p, 3003)
+    end
+    ok(same, "find long needles")
+    ok(select('#', buffer.find("abc", "x")) == 1, "find returns nil if not found")
+    ok(buffer.find("abc", "", 4) == 4 and buffer.find("abc", "", 5) == nil, "find empty string at end")
+    local b = buffer(s)
+    local i, j = b:find "needle"
+    ok(i == 301 and j == 306 and b:eq(s), "find does not change buffer ("..i..", "..j..")")
+    ok(b:find("needle", 302) == 407, "find with init")
+    ok(b:find(buffer "needle\0") == 407, "find buffer needle")
+    local i, j = buffer.find("hello world", "o w")
+    ok(i == 5 and j == 7, "find without specials")
+    local i, j = buffer.find("hello world", "o.w")
+    ok(i == 5 and j == 7, "find with pattern")
+    local i, j, c = buffer.find("key = value", "(%w+)%s*=")
+    ok(i == 1 and j == 5 and c == "key", "find with captures")
+end
+
+function test_pattern()
+    test_msg "test pattern matching"
+    local function pack(...) return { n = select('#', ...), ... } end
+    local function same(t1, t2)
+        if t1.n ~= t2.n then return false end
+        for i = 1, t1.n do
+            if t1[i] ~= t2[i] then return false end
+        end
+        return true
+    end
+    local subject = "  key1 = value, Key_2=[a[b]c] (x(y)z) 0x1F, end.\0tail "
+    local patterns = { "%w+", "(%w+)%s*=%s*(%w+)", "%b()", "%b[]", "%f[%w]%w+",
+        "^%s*(%S+)", "(%d+)$", "()=()", "%x%x", "[%a_]+", "[^%s=,]+", "k.-=",
+        "e?n", "%s*", "(e)(n)(d)%.", "%z", "t%w*%s$", "(%w)%1", "[%]]", "." }
+    local same_find, same_match, same_gmatch, same_gsub = true, true, true, true
+    local b = buffer(subject)
+    for _, p in ipairs(patterns) do
+        for _, init in ipairs { 1, 5, 20, -10 } do
+            same_find = same_find and same(pack(b:find(p, init)), pack(subject:find(p, init)))
+            same_match = same_match and same(pack(b:match(p, init)), pack(subject:match(p, init)))
+        end
+        local t1, t2 = {}, {}
+        for a, c in b:gmatch(p) do t1[#t1+1] = tostring(a)..tostring(c) end
+        for a, c in subject:gmatch(p) do t2[#t2+1] = tostring(a)..tostring(c) end
+        same_gmatch = same_gmatch and table.concat(t1, "|") == table.concat(t2, "|")
+        local r1, n1 = buffer(subject):gsub(p, "<%0>")
+        local r2, n2 = subject:gsub(p, "<%0>")
+        same_gsub = same_gsub and r1:eq(r2) and n1 == n2
+    end
+    ok(same_find, "find patterns like string.find")
+    ok(same_match, "match patterns like string.match")
+    ok(same_gmatch, "gmatch patterns like string.gmatch")
+    ok(same_gsub, "gsub patterns like string.gsub")
+    ok(b:eq(subject), "matching does not change buffer")
+    local i, j, k = b:match("(%w+)%s*=", 1, true)
+    ok(i == 3 and j == 6 and k == nil, "match offsets ("..i..", "..j..")")
+    local i, j, k, l = b:match("()(%w+)", 1, true)
+    ok(i == 3 and j == 2 and k == 3 and l == 6, "match position capture as offsets")
+    local t = {}
+    for i, j in b:gmatch("%a+", 40, true) do t[#t+1] = i..":"..j end
+    ok(table.concat(t, " ") == "40:40 42:42 45:47 50:53", "gmatch offsets with init ("..table.concat(t, " ")..")")
+    local b = buffer "hello world"
+    local r, n = b:gsub("o", "0")
+    ok(r == b and n == 2 and b:eq "hell0 w0rld", "gsub in place ("..b..")")
+    local r, n = buffer.gsub("hello world", "(%w+)", "%1!")
+    ok(type(r) == "string" and r == "hello! world!" and n == 2, "gsub on string returns string")
+    local dst = buffer "> "
+    local src = buffer "a b c"
+    local r, n = src:gsub("%a", { a = "1", b = false }, nil, dst)
+    ok(r == dst and n == 3 and dst:eq "> 1 b c" and src:eq "a b c", "gsub into dst ("..dst..")")
+    local r, n = buffer "abc":gsub("%w", function(c) return c:upper() end, 2)
+    ok(r:eq "ABc" and n == 2, "gsub with function and max")
+    local b = buffer "x=1, y=2"
+    b:gsub("(%w+)=(%w+)", function(k, v)
+        b:reserve(4096) -- moves the storage of source
+        return v.."="..k
+    end)
+    ok(b:eq "1=x, 2=y", "gsub source moved by callback ("..b..")")
+    local b = buffer "hello world"
+    local v = b:sub(1, 5)
+    ok(not pcall(b.gsub, b, "o", ("O"):rep(40)) and b:eq "hello world",
+       "failed gsub keeps pinned buffer")
+    local s = buffer "abcabc":sub(1, 3)
+    ok(not pcall(s.gsub, s, "b", "BBBB") and s:eq "abc", "failed gsub keeps sub buffer")
+    ok(buffer.gsub("abc", buffer "b", buffer "%0%0") == "abbc", "gsub with buffer pattern and replacement")
+    ok(not pcall(buffer.match, "abc", "(%w"), "malformed pattern")
+    ok(not pcall(buffer.gsub, "abc", "%w", "%2"), "invalid capture index")
+    ok(not pcall(buffer.match, ("a"):rep(1000), ("a?"):rep(1000)..("a"):rep(1000)), "pattern too complex")
+end
+
 function test_pack()
     test_msg "test pack operation"
     local b, pos = buffer.pack("!s", "apple")
@@ -318,4 +560,744 @@ function test_pack()
     ok(a == 0x61626364 and b == 0x65666768, "unpack can work with lua string ("..("%08x, %08x"):format(a, b)..")")
 end
 
+function test_compile()
+    test_msg "test compiled format"
+    local function same(a, b)
+        if type(a) ~= type(b) then
+            if buffer.isbuffer(a) or buffer.isbuffer(b) then
+                return buffer.eq(a, b)
+            end
+            return false
+        end
+        if type(a) ~= "table" then
+            return a == b or buffer.isbuffer(a) and a:eq(b)
+        end
+        for k, v in pairs(a) do
+            if not same(v, b[k]) then return false end
+        end
+        for k in pairs(b) do
+            if a[k] == nil then return false end
+        end
+        return true
+    end
+    local function check(fmt, ...)
+        local f = buffer.compile(fmt)
+        local r1 = {buffer.pack(fmt, ...)}
+        local r2 = {f:pack(...)}
+        ok(same(r1, r2), "pack with compiled format ("..fmt..")")
+        for i = 1, #r1[1] + 1 do
+            local u1 = {r1[1]:unpack(i, fmt)}
+            local u2 = {f:unpack(r1[1], i)}
+            local u3 = {r1[1]:unpack(i, f)}
+            if not same(u1, u2) or not same(u1, u3) then
+                ok(false, "unpack with compiled format ("..fmt..", "..i..")")
+                return
+            end
+        end
+        ok(true, "unpack with compiled format ("..fmt..")")
+    end
+    check("!s", "apple")
+    check("i1 u2 >i3 <u4 i8 f f8", 1, 2, 3, 4, -5, 6.5, 7.25)
+    check("p#", "apple")
+    check("!p d2 B2 c3 z Z", "apple", "pie", "xy", "zzz", "s", "b")
+    check("{ a = i, b = { c = s, d = f8 }, e = { i, i } } #", {
+        a = 1, b = { c = "apple", d = 0.5 }, e = { 2, 3 } })
+    check("{ i*3 } u2*2", { 1, 2, 3 }, 4, 5)
+    check("i2 @1 i1 +2 i1 -1 i1", 0x1234, 5, 6, 7)
+    check("{{z}} #", {{"apple"}})
+    local f = buffer.compile "{ name = s, age = i1 }"
+    local b = f:pack { name = "apple", age = 3 }
+    local t = f:unpack(b)
+    ok(t.name == "apple" and t.age == 3, "unpack named fields ("..t.name..")")
+    local b, pos = buffer "" :pack(f, { name = "pie", age = 4 })
+    ok(pos == 6 and b:eq "pie\0\4", "pack into buffer with compiled format ("..b:quote()..")")
+    ok(not pcall(buffer.compile, "{i"), "compile unbalanced format")
+    ok(not pcall(buffer.compile, "x"), "compile invalid format")
+    ok(not pcall(buffer.compile, "i9"), "compile invalid wide")
+end
+
+function test_records()
+    test_msg "test unpack records"
+    local b = buffer()
+    for i = 1, 10 do b:pack(#b+1, ">i2 u1", i * 100, i) end
+    local t, n, pos = b:unpackrecords(">i2 u1", 10)
+    ok(n == 10 and #t == 10 and pos == 31, "unpack all records ("..n..", "..pos..")")
+    ok(t[1][1] == 100 and t[1][2] == 1 and t[10][1] == 1000 and t[10][2] == 10,
+        "records are arrays of values")
+    local t, n, pos = b:unpackrecords(4, ">i2 u1", 2, true)
+    ok(n == 2 and pos == 10 and #t == 2 and t[1][2] == 300 and t[2][2] == 3,
+        "unpack columns ("..t[1][1]..", "..t[1][2]..")")
+    local t, n = b:unpackrecords(buffer.compile ">{ v = i2, k = u1 }", nil, true)
+    ok(n == 10 and #t.v == 10 and t.v[7] == 700 and t.k[7] == 7,
+        "unpack named columns with compiled format")
+    local t, n = b:unpackrecords(">{ v = i2, k = u1 }")
+    ok(n == 10 and t[5].v == 500 and t[5].k == 5, "records are tables of fields")
+    local t, n, pos = b:unpackrecords(-4, ">i2 u1", 5)
+    ok(n == 1 and #t == 1 and pos == 30, "stop at incomplete record ("..n..", "..pos..")")
+    local t, n, pos = b:unpackrecords(">i4", 100)
+    ok(n == 7 and t[1] == 0x00640100 and pos == 29,
+        "single value records ("..n..", "..pos..")")
+    local t, n, pos = buffer.unpackrecords("ab\0cd\0e", "z")
+    ok(n == 2 and t[1] == "ab" and t[2] == "cd" and pos == 7,
+        "unpack records from string ("..n..", "..pos..")")
+    local t, n, pos = b:unpackrecords("@1 i1")
+    ok(n == 2 and pos == 2, "stop at record without progress ("..n..", "..pos..")")
+end
+
+function test_array()
+    test_msg "test numeric arrays"
+    for w = 1, 8 do
+        local b = buffer.pack("<i"..w..">i"..w, -2, -3)
+        local a, c = b:unpack("<i"..w..">i"..w)
+        ok(a == -2 and c == -3, "unpack "..w.." wide signed numbers ("..a..", "..c..")")
+        local a = b:unpack("<u"..w)
+        ok(w > 6 or a == 2^(w*8) - 2, "unpack "..w.." wide unsigned number ("..a..")")
+    end
+    ok(buffer.unpack("\1\2\3\4\5\6\7\8", "<i8") == 0x0807060504030201,
+        "unpack little endian 64bit number")
+    ok(buffer.unpack("\1\2\3\4\5\6\7\8", ">i8") == 0x0102030405060708,
+        "unpack big endian 64bit number")
+    local b = buffer()
+    local b2, pos = b:setarray(1, "i2>", { 1, -2, 0x1234 })
+    ok(b2 == b and pos == 7 and b:eq "\0\1\255\254\18\52", "set big endian array ("..b:tohex' '..")")
+    local b2, pos = b:setarray(pos, "<u2", { 1, 2, 3, 4 }, 2, 3)
+    ok(pos == 11 and b:eq "\0\1\255\254\18\52\2\0\3\0", "set part of array ("..b:tohex' '..")")
+    local t, pos = b:getarray("i2>")
+    ok(#t == 5 and t[1] == 1 and t[2] == -2 and t[3] == 0x1234 and t[4] == 0x200 and pos == 11,
+        "get all elements of array ("..#t..", "..pos..")")
+    local t, pos = b:getarray(7, "u2<", 1)
+    ok(#t == 1 and t[1] == 2 and pos == 9, "get count elements of array ("..#t..", "..pos..")")
+    local t, pos = b:getarray(-3, "u2")
+    ok(#t == 1 and pos == 10, "get array stops at end of data ("..#t..", "..pos..")")
+    local src = {}
+    for i = 1, 100 do src[i] = i * 0.5 - 20 end
+    for _, type in ipairs { "f4", "f8<", ">f8", "f" } do
+        local t = buffer():setarray(type, src):getarray(type)
+        local same = #t == 100
+        for i = 1, 100 do same = same and t[i] == src[i] end
+        ok(same, "float array round trip ("..type..")")
+    end
+    for _, type in ipairs { "i1", "u3>", "i5<", "i6>", "u7", "i8>" } do
+        local t = buffer():setarray(type, { 1, 100, 127 }):getarray(type)
+        ok(t[1] == 1 and t[2] == 100 and t[3] == 127, "integer array round trip ("..type..")")
+    end
+    local t = buffer "abc":getarray "i4"
+    ok(#t == 0, "get array from short data")
+    ok(not pcall(buffer.setarray, buffer(), "i4", { 1, "x" }), "set array with invalid element")
+    ok(not pcall(buffer.getarray, "abcd", "i9"), "get array with invalid wide")
+    ok(not pcall(buffer.getarray, "abcd", "f2"), "get array with invalid float wide")
+    ok(not pcall(buffer.getarray, "abcd", "x4"), "get array with invalid type")
+end
+
+function test_hex()
+    test_msg "test hex encoding"
+    local function tohex(s, group, sep, gsep, upper)
+        local hexfmt = upper and "%02X" or "%02x"
+        local t = {}
+        for i = 1, #s do
+            if i ~= 1 then
+                t[#t+1] = group and (i-1) % group == 0 and gsep or sep
+            end
+            t[#t+1] = hexfmt:format(s:byte(i))
+        end
+        return table.concat(t)
+    end
+    local s = ""
+    for i = 0, 255 do s = s..string.char(i) end
+    local same = true
+    for len = 0, 40 do
+        local str = s:sub(200 - len, 199)
+        same = same and buffer.tohex(str) == tohex(str, nil, "")
+            and buffer.tohex(str, " ", true) == tohex(str, nil, " ", nil, true)
+            and buffer.tohex(str, 4, ", ", "\n") == tohex(str, 4, ", ", "\n")
+            and buffer.tohex(str, 16) == tohex(str, 16, "", "\n")
+            and buffer.tohex(buffer(str), 3, "", "|", true) == tohex(str, 3, "", "|", true)
+    end
+    ok(same, "tohex with options")
+    ok(buffer.tohex(s, "") == tohex(s, nil, ""), "tohex all bytes")
+    ok(buffer(s):tohex() == buffer.tohex(s), "tohex returns string")
+    local b = buffer(buffer.tohex(s, " "))
+    local b2, err = b:fromhex()
+    ok(b2 == b and err == nil and b:eq(s), "fromhex in place ("..#b..")")
+    local b, err = buffer "<":fromhex "DE:AD be-ef\n00"
+    ok(err == nil and b:eq "<\222\173\190\239\0", "fromhex appends with separators ("..b:quote()..")")
+    local b, err = buffer():fromhex "0102 0g"
+    ok(err == 6 and b:eq "\1\2", "fromhex reports invalid char ("..tostring(err)..")")
+    local b, err = buffer():fromhex "01 2"
+    ok(err == 4 and b:eq "\1", "fromhex reports incomplete byte ("..tostring(err)..")")
+    local b, err = buffer "414243zz":fromhex()
+    ok(err == 7 and b:eq "ABC", "fromhex in place stops at invalid char ("..tostring(err)..")")
+end
+
+function test_base64()
+    test_msg "test base64 encoding"
+    local vectors = {
+        { "", "" }, { "f", "Zg==" }, { "fo", "Zm8=" }, { "foo", "Zm9v" },
+        { "foob", "Zm9vYg==" }, { "fooba", "Zm9vYmE=" }, { "foobar", "Zm9vYmFy" },
+    }
+    for _, v in ipairs(vectors) do
+        local e = buffer.tobase64(v[1])
+        ok(buffer.isbuffer(e) and e:eq(v[2]), "tobase64 ("..v[2]..")")
+        ok(buffer.frombase64(v[2]):eq(v[1]), "frombase64 ("..v[2]..")")
+    end
+    local s = ""
+    for i = 0, 255 do s = s..string.char(i) end
+    s = s:rep(3)..s:sub(1, 100)
+    local e = buffer(s):tobase64()
+    ok(buffer.frombase64(e):eq(s), "base64 round trip ("..#e..")")
+    local u = buffer.tobase64(s, true)
+    ok(not tostring(u):find("[+/=]") and #u == math.ceil(#s * 4 / 3), "base64url has no padding")
+    ok(u:frombase64():eq(s), "frombase64 accepts url alphabet")
+    ok(buffer.tobase64("xfoobarx", 2, -2):eq "Zm9vYmFy", "tobase64 with range")
+    ok(buffer.tobase64("\251\255", 1, 2, true):eq "-_8", "tobase64 url with range")
+    ok(buffer.frombase64("Zm9v\r\nYmFy\n"):eq "foobar", "frombase64 skips spaces")
+    local r, pos = buffer.frombase64 "Zm9v*mFy"
+    ok(r == nil and pos == 5, "frombase64 reports invalid char ("..tostring(pos)..")")
+    local r, pos = buffer.frombase64 "Zm9vY"
+    ok(r == nil and pos == 6, "frombase64 reports truncated data ("..tostring(pos)..")")
+    local r, pos = buffer.frombase64 "Zg==Zg=="
+    ok(r == nil and pos == 5, "frombase64 rejects data after padding ("..tostring(pos)..")")
+    local r, pos = buffer.frombase64 "QQ===="
+    ok(r == nil and pos == 5, "frombase64 rejects extra padding ("..tostring(pos)..")")
+    local r, pos = buffer.frombase64 "QQ="
+    ok(r == nil and pos == 4, "frombase64 rejects partial padding ("..tostring(pos)..")")
+    local r, pos = buffer.frombase64 "QUJD="
+    ok(r == nil and pos == 5, "frombase64 rejects padding of whole quad ("..tostring(pos)..")")
+    ok(buffer.frombase64("QQ= =\n"):eq "A" and buffer.frombase64("QUI="):eq "AB"
+       and buffer.frombase64("QQ"):eq "A", "frombase64 exact or no padding")
+
+    local enc, out = buffer.base64(), buffer "data:"
+    for i = 1, #s, 7 do enc:encode(out, s, i, i + 6) end
+    ok(enc:finish(out) == out and out:eq("data:"..e), "streaming base64 encode")
+    local dec, res = buffer.base64(), buffer()
+    local same = true
+    for i = 6, #out, 5 do
+        same = same and dec:decode(res, out, i, i + 4) == res
+    end
+    ok(same and dec:finish(res) == res and res:eq(s), "streaming base64 decode")
+    local enc = buffer.base64(true)
+    local b = buffer()
+    enc:encode(b, "f") enc:encode(b, "o") enc:finish(b)
+    ok(b:eq "Zm8", "streaming base64url encode ("..b..")")
+    local dec = buffer.base64()
+    local r, pos = dec:decode(buffer(), "Zm9v!")
+    ok(r == nil and pos == 5, "streaming decode reports invalid char")
+    local dec = buffer.base64()
+    dec:decode(buffer(), "Z")
+    local r, msg = dec:finish(buffer())
+    ok(r == nil and msg, "streaming decode reports truncated data")
+    local enc = buffer.base64()
+    enc:encode(buffer(), "a")
+    ok(not pcall(enc.decode, enc, buffer(), "YQ=="), "stream can not decode while encoding")
+    local b = buffer "foo"
+    ok(buffer.base64():encode(b, b) == b and b:eq "fooZm9v", "stream encodes buffer into itself")
+end
+
+function test_matcher()
+    test_msg "test multiple patterns matcher"
+    local m = buffer.matcher { "he", "she", "his", "hers" }
+    local starts, ids = m:scan "ushers"
+    ok(table.concat(starts, ",") == "2,3,3" and table.concat(ids, ",") == "2,1,4",
+       "matcher finds overlapped patterns")
+    local res = {}
+    for s, e, id in m:gmatch(buffer "ahishers") do
+        res[#res+1] = s..":"..e..":"..id
+    end
+    ok(table.concat(res, " ") == "2:4:3 4:6:2 5:6:1 5:8:4", "matcher gmatch")
+    local starts = m:scan("ushers", 3, 5)
+    ok(table.concat(starts, ",") == "3", "matcher scan with range")
+    ok(#m:scan "abcdefg" == 0, "matcher no matches")
+    ok(#m:scan "" == 0, "matcher scans empty data")
+
+    local long = ("x"):rep(100).."needle"..("y"):rep(50).."hay"..("z"):rep(40)
+    local m = buffer.matcher { "needle", buffer "hay" }
+    local starts, ids = m:scan(buffer(long))
+    ok(table.concat(starts, ",") == "101,157" and table.concat(ids, ",") == "1,2",
+       "matcher skips long runs of data")
+    local m = buffer.matcher { "a", "b", "c", "d", "e", "ab" }
+    local starts, ids = m:scan(("-"):rep(37).."ab"..("-"):rep(20).."e")
+    ok(table.concat(starts, ",") == "38,38,39,60" and table.concat(ids, ",") == "1,6,2,5",
+       "matcher with many first bytes")
+    local m = buffer.matcher { "aa" }
+    ok(#m:scan "aaaa" == 3, "matcher finds self overlapped pattern")
+    local iter = m:gmatch "aaa"
+    ok(iter() == 1 and iter() == 2 and iter() == nil and iter() == nil,
+       "matcher iterator ends")
+    local all = {}
+    for i = 0, 255 do all[#all+1] = string.char(i) end
+    local starts, ids = buffer.matcher(all):scan "\255\0"
+    ok(table.concat(starts, ",") == "1,2" and table.concat(ids, ",") == "256,1",
+       "matcher with all bytes in patterns")
+    ok(not pcall(buffer.matcher, { "a", "" }), "matcher rejects empty pattern")
+    local r, msg = pcall(buffer.matcher, { "ab", "b", buffer "ab" })
+    ok(not r and msg:match "duplicate patterns in %[1%] and %[3%]", "matcher rejects duplicate patterns")
+    ok(not pcall(buffer.matcher, {}), "matcher requires patterns")
+end
+
+function test_sub()
+    test_msg "test sub buffers"
+    local b = buffer "apply pie, and a long tail to put the buffer on heap"
+    local sb = b:sub(1, 5)
+    ok(sb:eq "apply" and b:subcount() == 1, "sub buffer aliases parent")
+    ok(sb:offset() == 1 and select(2, sb:offset()) == b, "offset of sub buffer")
+    sb:set(5, "e")
+    ok(b:eq "apple pie, and a long tail to put the buffer on heap", "sub buffer writes through")
+    local tail = b:sub(7, -1)
+    local sb2 = tail:sub(1, 3)
+    ok(sb2:eq "pie" and sb2:offset() == 7 and b:subcount() == 3
+       and tail:subcount() == 0, "sub buffer of sub buffer")
+    tail:release()
+    sb2:upper()
+    ok(tostring(b):sub(1, 10) == "apple PIE,", "nested sub buffer writes through")
+    b:set(1, "APP")
+    ok(sb:eq "APPle", "sub buffer sees changes of parent")
+    ok(buffer.find(sb2, "I") == 2 and buffer.tohex(sb2) == "504945", "sub buffer as string")
+    ok(not pcall(b.insert, b, ("x"):rep(100)), "pinned parent can not grow")
+    ok(not pcall(sb.insert, sb, "x"), "sub buffer can not grow")
+    ok(b:sub(3, 2):eq "" and b:sub(-3):eq "eap", "sub buffer range")
+    sb:set(2, sb2)
+    ok(sb:eq "APIEe", "copy between sub buffers")
+    ok(sb:release():eq "" and sb:offset() == nil, "release sub buffer")
+    sb2:release()
+    collectgarbage() collectgarbage()
+    ok(b:subcount() == 0, "parent unpinned")
+    b:insert(("x"):rep(100))
+    ok(#b == 152, "parent grows again")
+    local b = buffer "small"
+    b:sub(2, 3)
+    collectgarbage() collectgarbage()
+    ok(b:subcount() == 0 and b:insert(("x"):rep(100)) and #b == 105,
+       "collected sub buffers unpin parent")
+end
+
+function test_gap()
+    test_msg "test gap mode"
+    local b = buffer "hello world"
+    ok(b:mode() == "normal" and b:mode "gap" == b and b:mode() == "gap", "set gap mode")
+    b:insert(6, ",")
+    b:insert(7, " big")
+    ok(#b == 16 and b:eq "hello, big world", "insert in gap mode")
+    b:remove(1, 1)
+    b[1] = "Je"
+    b[#b] = "D"
+    ok(b[-1] == ("D"):byte() and b:eq "Jello, big worlD", "replace in gap mode")
+    b:insert "!"
+    ok(tostring(b) == "Jello, big worlD!", "append in gap mode")
+
+    math.randomseed(42)
+    local s = ""
+    local b = buffer():mode "gap"
+    for i = 1, 2000 do
+        local op, pos = math.random(4), math.random(#s + 1)
+        if op == 1 and #s > 0 then
+            local len = math.random(3)
+            b:remove(pos, pos + len - 1)
+            s = s:sub(1, pos - 1) .. s:sub(pos + len)
+        elseif op == 2 and pos <= #s then
+            b[pos] = "xy"
+            s = s:sub(1, pos - 1) .. "xy" .. s:sub(pos + 1)
+        else
+            local t = ("%d,"):format(i)
+            b:insert(pos, t)
+            s = s:sub(1, pos - 1) .. t .. s:sub(pos)
+        end
+        if i % 500 == 0 and not b:eq(s) then break end
+    end
+    ok(b:eq(s) and #b == #s, "random edits in gap mode")
+    ok(b:mode "normal":mode() == "normal" and b:eq(s), "back to normal mode")
+
+    local b = buffer "0123456789abcdef":mode "gap"
+    local v = b:sub(1, 10)
+    b:insert(3, "Z")
+    ok(tostring(v) == "01Z2345678" and b:eq "01Z23456789abcdef",
+       "sub buffer of buffer in gap mode")
+end
+
+function test_consume()
+    test_msg "test consuming from front"
+    local b = buffer():reserve(100)
+    local cap = b:capacity()
+    b:insert(("0123456789"):rep(8))
+    b:remove(1, 30)
+    local head = b:sub(1, 3)
+    ok(#b == 50 and head:eq "012" and b[1] == ("0"):byte(), "remove from front")
+    head:release()
+    ok(b:find "789" == 8 and b:byte(-1) == ("9"):byte(), "positions after remove from front")
+    ok(b:capacity() == cap, "capacity keeps consumed space")
+    b:reserve(cap - 10)
+    ok(b:capacity() == cap and #b == 50 and b[1] == ("0"):byte(),
+       "reserve counts consumed space")
+    b:insert(("x"):rep(cap - 50))
+    ok(#b == cap and b:capacity() == cap and tostring(b):sub(-4) == "xxxx", "consumed space reused")
+    b:remove(1, -1)
+    ok(#b == 0 and b:capacity() == cap, "consume all")
+
+    local q, s = buffer(), ""
+    for i = 1, 200 do
+        local frame = ("%d:"):format(i):rep(i % 7 + 1)
+        q:insert(frame); s = s .. frame
+        local n = i % 3 * 5
+        q:remove(1, n); s = s:sub(n + 1)
+    end
+    ok(q:eq(s), "buffer as a queue")
+    local sb = q:sub(1, 4)
+    q:remove(1, 2)
+    ok(sb:eq(s:sub(3, 6)) and q:eq(s:sub(3)), "pinned buffer moves content")
+    local b = buffer(("x"):rep(40).."ABCD")
+    b:remove(1, 10)
+    local sb = b:sub(31, 34)
+    ok(not pcall(b.insert, b, ("y"):rep(28)) and sb:eq "ABCD",
+       "pinned buffer does not reuse consumed space")
+end
+
+function test_file()
+    test_msg "test file reading"
+    local fh = assert(io.open "test.lua")
+    local content = fh:read "*a"
+    fh:close()
+    local b = assert(buffer.load "test.lua")
+    ok(b:eq(content), "load whole file")
+    local r, msg = buffer.load "no-such-file"
+    ok(r == nil and msg:match "^no%-such%-file: ", "load reports error")
+
+    local fh = assert(io.open "test.lua")
+    local b = buffer "header:"
+    local _, n = b:readfrom(fh, 10)
+    ok(n == 10 and b:eq("header:"..content:sub(1, 10)), "readfrom n bytes")
+    local _, n = b:readfrom(fh)
+    ok(n == #content - 10 and b:eq("header:"..content), "readfrom rest of file")
+    local r, n = b:readfrom(fh)
+    ok(r == b and n == 0, "readfrom at end of file")
+    fh:seek("set", 0)
+    local b = buffer "0123456789"
+    b:readfrom(3, fh, 4)
+    ok(b:eq("01"..content:sub(1, 4).."6789"), "readfrom at position")
+    b:readfrom(-1, fh, 2)
+    ok(b:eq("01"..content:sub(1, 4).."678"..content:sub(5, 6)), "readfrom at last byte")
+    local v = b:sub(1, 2)
+    fh:seek("set", 0)
+    ok(not pcall(b.readfrom, b, 3, fh) and b:eq("01"..content:sub(1, 4).."678"..content:sub(5, 6)),
+       "failed readfrom keeps length")
+    v:release()
+    fh:seek("set", 0)
+    ok(buffer(fh):eq(content), "buffer from file")
+    fh:close()
+    ok(not pcall(b.readfrom, b, fh), "readfrom closed file")
+
+    local okp, ph = pcall(io.popen, "echo hello")
+    if okp and ph then
+        local b = buffer()
+        b:readfrom(ph)
+        ok(b:eq "hello\n", "readfrom pipe")
+        ph:close()
+    end
+end
+
+function test_mmap()
+    test_msg "test memory mapped buffers"
+    local fh = assert(io.open "test.lua")
+    local content = fh:read "*a"
+    fh:close()
+    local b, msg = buffer.mmap "test.lua"
+    if not b and msg:match "not implemented" then return end
+    ok(b and b:eq(content), "map file")
+    ok(b:find "test_mmap" == content:find "test_mmap" and b:cmp(content) == 0,
+       "find and cmp in mapped buffer")
+    ok(b:getuint(1, 4) == buffer.getuint(content, 1, 4), "getint in mapped buffer")
+    ok(b:unpack "s4" == content:sub(1, 4), "unpack mapped buffer")
+    ok(not pcall(b.set, b, 1, "x") and not pcall(b.upper, b)
+       and not pcall(b.insert, b, "x") and b:eq(content), "read-only buffer")
+    local sb = b:sub(1, 5)
+    local r, msg = pcall(sb.set, sb, 1, "J")
+    ok(not r and msg:match "read%-only buffer" and b:eq(content),
+       "sub buffer of read-only buffer")
+    local r, msg = buffer.mmap "no-such-file"
+    ok(r == nil and msg:match "^no%-such%-file: ", "mmap reports error")
+    ok(buffer.mmap(".") == nil, "mmap directory")
+
+    local c = assert(buffer.mmap("test.lua", "c"))
+    c:set(1, "--")
+    c:upper(3, 10)
+    ok(c:eq("--"..content:sub(3, 10):upper()..content:sub(11)), "copy-on-write buffer")
+    ok(b:eq(content), "file not changed")
+    c:insert "tail"
+    ok(c:eq("--"..content:sub(3, 10):upper()..content:sub(11).."tail"), "grow moves to heap")
+    local sb = c:sub(1, 2)
+    ok(sb:eq "--", "sub buffer of mapped buffer")
+    c:remove(1, 2)
+    ok(#c == #content + 2, "remove from buffer moved to heap")
+    local c = assert(buffer.mmap("test.lua", "c"))
+    c:remove(1, 10)
+    ok(c:eq(content:sub(11)), "remove from front of mapped buffer")
+    c:insert "!"
+    ok(c:eq(content:sub(11).."!"), "grow mapped buffer after remove")
+end
+
+function test_write()
+    test_msg "test writing to files"
+    local name = os.tmpname()
+    local fh = assert(io.open(name, "w+b"))
+    local b = buffer "hello world"
+    local r, n = b:writeto(fh)
+    ok(r == b and n == 11, "writeto file handle")
+    b:writeto(fh, 6)
+    ok(buffer.writev(fh, { "1", buffer "23", "" }) == 3, "writev file handle")
+    fh:seek("set", 0)
+    ok(fh:read "*a" == "hello world world123", "content written to file handle")
+    fh:close()
+    ok(not pcall(b.writeto, b, fh), "writeto closed file")
+
+    local fh = assert(io.open(name, "w+b"))
+    local ok_fd, fd = pcall(buffer.fileno, fh)
+    if ok_fd and pcall(b.writeto, b, fd, 1, 0) then
+        local big = buffer(100000, "0123456789")
+        local _, n = big:writeto(fd, 2, -2)
+        ok(n == 99998, "writeto fd")
+        local t = {}
+        for i = 1, 200 do
+            t[i] = i % 3 == 0 and i or i % 3 == 1 and buffer(tostring(i)) or tostring(i)
+        end
+        t[#t+1] = big
+        local n = buffer.writev(fd, t)
+        local expect = {}
+        for i = 1, 200 do expect[i] = tostring(i) end
+        expect = table.concat(expect)
+        ok(n == #expect + #big, "writev fd with many items")
+        fh:seek("set", 0)
+        local content = fh:read "*a"
+        ok(content == tostring(big):sub(2, -2)..expect..tostring(big), "content written to fd")
+        local r, msg, en, written = b:writeto(-1 + 1000000)
+        ok(r == nil and type(msg) == "string" and type(en) == "number" and written == 0,
+           "writeto bad fd")
+        ok(not pcall(buffer.writev, fd, { 1, {} }), "writev rejects bad items")
+    end
+    fh:close()
+    os.remove(name)
+end
+
+function test_fd()
+    test_msg "test raw reading/writing of file descriptors"
+    local name = os.tmpname()
+    local fh = assert(io.open(name, "w+b"))
+    local ok_fd, fd = pcall(buffer.fileno, fh)
+    if ok_fd and pcall(buffer.writefd, "", fd) then
+        local data = buffer(50000, "abcdefghij")
+        local b = buffer "head"
+        ok(select(2, b:writefd(fd, 1, 4)) == 4, "writefd range")
+        local r, n = data:writefd(fd)
+        ok(r == data and n == 50000, "writefd whole buffer")
+        fh:seek("set", 0)
+        local r, n = b:readfd(fd, 6)
+        ok(r == b and n == 6 and b:eq "headheadab", "readfd with maxbytes")
+        local r, n = b:readfd(fd)
+        local total = 6
+        while r and n > 0 do total = total + n; r, n = b:readfd(fd) end
+        ok(r == b and n == 0 and total == 50004, "readfd until end of file")
+        ok(b:eq("headhead"..tostring(data)), "content read by readfd")
+        local r, msg, en = b:readfd(-1 + 1000000)
+        ok(r == nil and type(msg) == "string" and type(en) == "number", "readfd bad fd")
+        r, msg, en = b:writefd(1000000)
+        ok(r == nil and type(en) == "number", "writefd bad fd")
+        ok(not pcall(buffer.readfd, buffer.mmap(name), fd), "readfd read-only buffer")
+    end
+    fh:close()
+    os.remove(name)
+
+    -- a fifo opened for reading and writing, made non-blocking by a
+    -- child process, which shares the open file description
+    local fifo = os.tmpname()
+    os.remove(fifo)
+    local r = os.execute("mkfifo "..fifo.." 2>/dev/null")
+    local fh = (r == true or r == 0) and io.open(fifo, "r+b")
+    if ok_fd and fh then
+        local fd = buffer.fileno(fh)
+        r = os.execute(("python3 -c 'import fcntl, os; fcntl.fcntl(%d, "..
+            "fcntl.F_SETFL, os.O_NONBLOCK)' 2>/dev/null"):format(fd))
+        if r == true or r == 0 then
+            local r, msg, en = buffer():readfd(fd)
+            ok(r == false and type(msg) == "string" and type(en) == "number",
+               "readfd would block")
+            local data, total = buffer(65536, "x"), 0
+            local r, n = data:writefd(fd)
+            while r do total = total + n; r, n = data:writefd(fd) end
+            ok(r == false and total > 0, "writefd would block ("..total..")")
+            local b = buffer()
+            r, n = b:readfd(fd, 10)
+            ok(r == b and n == 10 and b:eq(("x"):rep(10)), "readfd non-blocking fd")
+        end
+        fh:close()
+    end
+    os.remove(fifo)
+end
+
+function test_decoder()
+    test_msg "test streaming decoder"
+    local fmt = ">u2 { name = d1, vals = { i2 * 3 } } z"
+    local data = buffer.pack(fmt, 7, { name = "abc", vals = { 1, -2, 3 } }, "end")
+    data:pack(#data + 1, fmt, 8, { name = "xy", vals = { 4, 5, 6 } }, "fin")
+    local got, n = {}, 0
+    local d = buffer.decoder(fmt, function(id, t, s)
+        got[#got+1] = id..":"..t.name..":"..table.concat(t.vals, ",")..":"..s
+    end)
+    for i = 1, #data do n = n + d:feed(data, i, i) end
+    ok(n == 2 and table.concat(got, " ") == "7:abc:1,-2,3:end 8:xy:4,5,6:fin",
+       "records resumed across one byte chunks")
+    ok(#d:buffer() == 0, "decoded bytes are consumed")
+
+    local d = buffer.decoder(buffer.compile "!<i4 c3")
+    d:feed "\1\0\0"
+    ok(d:decode() == nil, "incomplete integer")
+    d:feed "\0ab"
+    ok(d:decode() == nil, "incomplete chars are not truncated")
+    d:feed "c\2\0\0\0xyz\3"
+    local t = {}
+    for pos, i, s in d:records() do t[#t+1] = pos..i..s end
+    ok(table.concat(t, " ") == "81abc 82xyz", "records iterator")
+    ok(#d:buffer() == 1, "incomplete record is kept")
+    ok(d:reset() == d and #d:buffer() == 0, "reset decoder")
+    d:buffer():insert "\9\0\0\0abc"
+    ok(select(2, d:decode()) == 9, "data appended to decoder buffer")
+
+    local d = buffer.decoder "@3 u1"
+    d:feed "ab"
+    ok(d:decode() == nil, "seek beyond data")
+    d:feed "cd"
+    ok(d:decode() == 99, "seek resumed")
+    local d = buffer.decoder ">d8"
+    d:feed(("\255"):rep(8))
+    ok(not pcall(d.decode, d), "decoding error")
+    d:feed "\0\0\0\0\0\0\0\1x"
+    ok(d:decode() == "x", "data dropped after error")
+    ok(not pcall(buffer.decoder, "i$"), "'$' rejected")
+    ok(not pcall(buffer.decoder, "i", 1), "callback must be function")
+    ok(buffer "ab":unpack "b2" == "ab", "strict bytes at end of data")
+
+    local fmt = "<i4 s3 { i1 } B2"
+    local data = buffer.pack(fmt, 5, "xyz", { 9 }, "zz")
+    local got
+    local d = buffer.decoder(fmt, function(i, s, t, b)
+        got = i..s..t[1]..tostring(b)
+    end)
+    for i = 1, #data do d:feed(data, i, i) end
+    ok(got == "5xyz9zz", "full width string waits for its terminator")
+end
+
+function test_varint()
+    test_msg "test varint formats"
+    local cases = {
+        { "v", 0, "00" }, { "v", 127, "7f" }, { "v", 300, "ac 02" },
+        { "v", 2^35 + 1, "81 80 80 80 80 01" },
+        { "v", -1, "ff ff ff ff ff ff ff ff ff 01" },
+        { "w", 0, "00" }, { "w", -1, "01" }, { "w", 1, "02" },
+        { "w", -65, "81 01" }, { "w", 2^40, "80 80 80 80 80 40" },
+        { "l", 63, "3f" }, { "l", 64, "c0 00" }, { "l", -64, "40" },
+        { "l", -123456, "c0 bb 78" }, { "l", -2^50, "80 80 80 80 80 80 80 7e" },
+    }
+    for _, c in ipairs(cases) do
+        local b, pos = buffer.pack("!"..c[1], c[2])
+        local upos, v = buffer.unpack(b, "!"..c[1])
+        ok(b:tohex " " == c[3] and pos == upos and v == c[2],
+           ("varint '%s' of %.0f (%s)"):format(c[1], c[2], b:tohex " "))
+        local b = buffer.pack("u1"..c[1]:upper().."u1", 1, c[2], 2) .. ("\0"):rep(8)
+        local x, v, y = buffer.unpack(b, "u1"..c[1].."u1")
+        ok(x == 1 and v == c[2] and y == 2, "varint '"..c[1].."' in long data")
+    end
+    local fmt = "{ id = v, vals = { w * 3 }, name = a, blob = A }"
+    local t = { id = 150, vals = { -1, 0, 1000 }, name = "apple", blob = "pie" }
+    local b = buffer.pack(fmt, t)
+    ok(b:tohex " " == "96 01 01 00 d0 0f 05 61 70 70 6c 65 03 70 69 65", "pack varints in block")
+    local r = b:unpack(fmt)
+    ok(r.id == 150 and r.vals[1] == -1 and r.vals[3] == 1000 and r.name == "apple"
+       and buffer.isbuffer(r.blob) and r.blob:eq "pie", "unpack varints in block")
+    local pos, s = buffer.unpack("\5abc", "!a")
+    ok(pos == 1 and s == nil, "incomplete varint length string")
+    ok(buffer.unpack("\128\128", "v") == nil, "incomplete varint")
+    ok(not pcall(buffer.unpack, ("\255"):rep(11), "v"), "too long varint")
+    ok(not pcall(buffer.compile, "v4"), "varint has no wide")
+    local res = b:unpackrecords("v", 2)
+    ok(res[1] == 150 and res[2] == 1, "unpack records of varints")
+end
+
+function test_bits()
+    test_msg "test bit field formats"
+    local b = buffer.pack(">n4 n4 n6 n2 u2", 4, 5, 46, 1, 0x1234)
+    ok(b:tohex " " == "45 b9 12 34", "pack big endian bit fields ("..b:tohex " "..")")
+    local v, ihl, dscp, ecn, len = b:unpack ">n4 n4 n6 n2 u2"
+    ok(v == 4 and ihl == 5 and dscp == 46 and ecn == 1 and len == 0x1234,
+       "unpack big endian bit fields")
+    local b, pos = buffer.pack("!<n3 n5 n12 m4 | u1", 5, 17, 0xABC, -3, 9)
+    ok(pos == 5 and b:tohex " " == "8d bc da 09", "pack little endian bit fields ("..b:tohex " "..")")
+    local pos, a, c, d, e, f = b:unpack "!<n3 n5 n12 m4 | u1"
+    ok(pos == 5 and a == 5 and c == 17 and d == 0xABC and e == -3 and f == 9,
+       "unpack little endian bit fields")
+    local t = buffer "\133" :unpack ">{ n1 * 8 }"
+    ok(#t == 8 and t[1] == 1 and t[2] == 0 and t[8] == 1, "bit fields with count in block")
+    local r = buffer "\255\1" :unpack "<{ a = n3, b = m5 } c1"
+    ok(r.a == 7 and r.b == -1, "bit fields with keys, and aligned by byte formats")
+    local x, y = buffer.unpack("\1", "n3 n6")
+    ok(x == 1 and y == nil, "incomplete bit field")
+    local b = buffer "\255\255"
+    b:pack(1, ">n4", 0)
+    ok(b:tohex " " == "0f ff", "pack bit field keeps other bits")
+    ok(not pcall(buffer.compile, "n65"), "bit field wide")
+    local got = {}
+    local d = buffer.decoder(">n4 n12", function(a, c) got[#got+1] = a..":"..c end)
+    d:feed "\65"
+    d:feed "\66\67\68"
+    ok(table.concat(got, " ") == "4:322 4:836", "decoder resumes in bit fields")
+end
+
+function test_checksum()
+    test_msg "test checksums"
+    ok(buffer.crc32 "123456789" == 0xCBF43926, "crc32 check value")
+    ok(buffer.crc32c "123456789" == 0xE3069283, "crc32c check value")
+    ok(buffer.adler32 "Wikipedia" == 0x11E60398, "adler32 check value")
+    ok(buffer.crc32 "" == 0 and buffer.crc32c "" == 0 and buffer.adler32 "" == 1,
+       "checksums of empty data")
+    local t = {}
+    for i = 0, 9999 do t[#t+1] = string.char((i * 7 + 3) % 251) end
+    local b = buffer(table.concat(t))
+    ok(b:crc32() == 0x3746C72A and b:crc32c() == 0xF04B9CA2 and b:adler32() == 0x7BCB1246,
+       "checksums of long data")
+    ok(b:crc32(3, -3) == 0x53BAED9F and b:crc32c(3, -3) == 0x653C72C8
+       and b:adler32(3, -3) == 0x5C4D108C, "checksums of range")
+    for _, f in ipairs { "crc32", "crc32c", "adler32" } do
+        local sum, pos = nil, 1
+        for _, n in ipairs { 1, 7, 63, 64, 65, 200, 1000 } do
+            sum = b[f](b, pos, pos + n - 1, sum)
+            pos = pos + n
+        end
+        sum = b[f](b, pos, -1, sum)
+        ok(sum == b[f](b), f.." of chunks")
+    end
+    ok(buffer(100000, "\255"):adler32() == 0x149A302C, "adler32 of long run of 0xFF")
+end
+
+function test_intern()
+    test_msg "test hash and intern cache"
+    local s = "hello world, hello buffer"
+    ok(buffer.hash(buffer(s)) == buffer.hash(s), "hash of buffer and string")
+    ok(buffer.hash(s, 1, 5) == buffer.hash "hello", "hash of range")
+    ok(buffer.hash(s, nil, nil, 1) ~= buffer.hash(s), "hash with seed")
+    ok(buffer.hash(("x"):rep(100)) ~= buffer.hash(("x"):rep(99).."y"), "hash of long data")
+    if math.type then -- 64-bit integers, test vectors of wyhash
+        ok(buffer.hash "" == 0x93228a4de0eec5a2
+           and buffer.hash("abc", nil, nil, 2) == 0xa97f2f7b1d9b3314
+           and buffer.hash(("1234567890"):rep(8), nil, nil, 6) == 0x6cc5eab49a92d617,
+           "hash test vectors")
+    end
+    local info = buffer.intern(100)
+    ok(info.slots == 128 and info.hits == 0 and info.misses == 0, "enable intern cache")
+    local b = buffer(("header-name-"):rep(5))
+    local s1, s2 = tostring(b), tostring(b)
+    ok(s1 == s2 and s1 == ("header-name-"):rep(5), "tostring with intern cache")
+    local t = b:unpack "{ c60 }"
+    info = buffer.intern()
+    ok(t[1] == s1 and info.hits == 2 and info.misses == 1, "intern cache hits")
+    local short = tostring(buffer "short")
+    ok(short == "short" and buffer.intern().misses == 1, "short strings are not cached")
+    ok(buffer.intern(false).slots == 0, "disable intern cache")
+    ok(tostring(b) == s1, "tostring without intern cache")
+end
+
 test()